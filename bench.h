@@ -0,0 +1,123 @@
+/*
+ Tiny benchmark harness shared by gradient.c and vector.c (make bench).
+
+ Every kernel is run reps times (each sample repeats it inner times), the
+ samples are sorted and reported as median and percentiles, cost per work
+ unit (pixel, segment, point) and throughput, as a table on stdout and as
+ JSON into a file so results can be compared between commits.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_MAX 64
+
+typedef struct {
+	const char *name;
+	const char *unit; //px, seg, pt...
+	double units; //Work units done by one call
+	int reps;
+	double median; //Nanoseconds per call
+	double p90;
+	double p99;
+	double min;
+} bench_result;
+
+bench_result bench_results[BENCH_MAX];
+int bench_count = 0;
+
+static double bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+	double da = *(const double*)a, db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+static double bench_percentile(double *sorted, int count, double p) {
+	int i = p * (count - 1) + 0.5;
+	return sorted[i];
+}
+
+// Number of samples, BENCH_REPS overrides the per kernel default
+static int bench_reps(int reps) {
+	char *env = getenv("BENCH_REPS");
+	if(env != NULL && atoi(env) > 0) return atoi(env);
+	return reps;
+}
+
+void bench_run(const char *name, void (*fn)(), double units, const char *unit, int reps, int inner) {
+	bench_result *res;
+	double *samples;
+	int i, j;
+
+	if(bench_count == BENCH_MAX) return;
+	reps = bench_reps(reps);
+	samples = malloc(reps * sizeof(double));
+
+	fn(); //warm up caches and lazily built tables
+	for(i = 0; i < reps; i++) {
+		double start = bench_now_ns();
+		for(j = 0; j < inner; j++) fn();
+		samples[i] = (bench_now_ns() - start) / inner;
+	}
+	qsort(samples, reps, sizeof(double), bench_cmp);
+
+	res = &bench_results[bench_count++];
+	res->name = name;
+	res->unit = unit;
+	res->units = units;
+	res->reps = reps;
+	res->median = bench_percentile(samples, reps, 0.5);
+	res->p90 = bench_percentile(samples, reps, 0.9);
+	res->p99 = bench_percentile(samples, reps, 0.99);
+	res->min = samples[0];
+	free(samples);
+
+	fprintf(stderr, "  %s done\n", name);
+}
+
+// Prints the table and writes the same data as JSON into json_path
+void bench_report(const char *program, const char *json_path) {
+	FILE *json;
+	int i;
+
+	printf("%-26s %6s %12s %12s %12s %10s %12s\n",
+		"kernel", "reps", "median us", "p90 us", "p99 us", "ns/unit", "Munit/s");
+	for(i = 0; i < bench_count; i++) {
+		bench_result *r = &bench_results[i];
+		printf("%-26s %6d %12.1f %12.1f %12.1f %7.2f/%-3s %12.2f\n",
+			r->name, r->reps, r->median / 1e3, r->p90 / 1e3, r->p99 / 1e3,
+			r->median / r->units, r->unit, r->units / r->median * 1e3);
+	}
+
+	json = fopen(json_path, "w");
+	if(json == NULL) {
+		printf("Error openning %s\n", json_path);
+		return;
+	}
+	fprintf(json, "{\n  \"program\": \"%s\",\n  \"results\": [\n", program);
+	for(i = 0; i < bench_count; i++) {
+		bench_result *r = &bench_results[i];
+		fprintf(json,
+			"    {\"name\": \"%s\", \"unit\": \"%s\", \"units\": %.0f, \"reps\": %d, "
+			"\"median_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"min_ns\": %.1f, "
+			"\"ns_per_unit\": %.4f, \"munits_per_s\": %.3f}%s\n",
+			r->name, r->unit, r->units, r->reps,
+			r->median, r->p90, r->p99, r->min,
+			r->median / r->units, r->units / r->median * 1e3,
+			(i + 1 < bench_count) ? "," : "");
+	}
+	fprintf(json, "  ]\n}\n");
+	fclose(json);
+	printf("\nJSON written to %s\n", json_path);
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ Frame stage instrumentation shared by gradient.c and vector.c.
+
+ Run a program with FRAME_TRACE=1 (or FRAME_TRACE=path.json) and every
+ stage wrapped in TRACE_BEGIN/TRACE_END is timed with the monotonic clock.
+ Samples go into a lock-free ring buffer, rolling p50/p95/p99 frame times
+ are printed every TRACE_REPORT frames and the ring is dumped at exit in
+ the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+
+ Without FRAME_TRACE every macro is a single untaken branch, compiling with
+ -DNO_TRACE removes them completely.
+*/
+
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define TRACE_RING (1 << 16) //Number of events kept, power of two
+#define TRACE_FRAMES 240 //Window of frame times used for percentiles
+#define TRACE_REPORT 120 //Print percentiles every this many frames
+
+typedef struct {
+	const char *stage; //Static string, never freed
+	int tid;
+	long long start_ns;
+	long long dur_ns;
+	atomic_uint seq; //index+1 once the slot is fully written
+} trace_event;
+
+int trace_enabled = 0;
+
+static char trace_path[256];
+static trace_event trace_ring[TRACE_RING];
+static atomic_uint trace_head;
+static long long trace_origin_ns;
+static double trace_frame_ms[TRACE_FRAMES];
+static unsigned int trace_frames;
+
+static long long trace_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Producers claim a slot with one atomic add, several threads may record at once
+static void trace_record(const char *stage, int tid, long long start_ns, long long end_ns) {
+	unsigned int index = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+	trace_event *ev = &trace_ring[index & (TRACE_RING - 1)];
+
+	atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+	ev->stage = stage;
+	ev->tid = tid;
+	ev->start_ns = start_ns;
+	ev->dur_ns = end_ns - start_ns;
+	atomic_store_explicit(&ev->seq, index + 1, memory_order_release);
+}
+
+static int trace_cmp(const void *a, const void *b) {
+	double da = *(const double*)a, db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+static void trace_percentiles() {
+	double sorted[TRACE_FRAMES];
+	int count = (trace_frames < TRACE_FRAMES) ? trace_frames : TRACE_FRAMES;
+
+	memcpy(sorted, trace_frame_ms, count * sizeof(double));
+	qsort(sorted, count, sizeof(double), trace_cmp);
+	fprintf(stderr, "frame %u: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms (last %d frames)\n",
+		trace_frames,
+		sorted[(int)(0.50 * (count - 1))],
+		sorted[(int)(0.95 * (count - 1))],
+		sorted[(int)(0.99 * (count - 1))],
+		count);
+}
+
+// Writes complete events ("ph":"X") still present in the ring
+static void trace_dump() {
+	unsigned int head = atomic_load_explicit(&trace_head, memory_order_acquire);
+	unsigned int first = (head > TRACE_RING) ? head - TRACE_RING : 0;
+	unsigned int i;
+	int written = 0;
+	FILE *out = fopen(trace_path, "w");
+
+	if(out == NULL) {
+		fprintf(stderr, "Error openning %s\n", trace_path);
+		return;
+	}
+	fprintf(out, "{\"traceEvents\":[\n");
+	for(i = first; i < head; i++) {
+		trace_event *ev = &trace_ring[i & (TRACE_RING - 1)];
+		if(atomic_load_explicit(&ev->seq, memory_order_acquire) != i + 1) continue;
+		fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			written++ ? ",\n" : "", ev->stage, ev->tid,
+			(ev->start_ns - trace_origin_ns) / 1e3, ev->dur_ns / 1e3);
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(out);
+	fprintf(stderr, "trace with %d events written to %s\n", written, trace_path);
+}
+
+// Reads FRAME_TRACE, program is used for the default trace file name
+void trace_init(const char *program) {
+	char *env = getenv("FRAME_TRACE");
+
+	if(env == NULL || *env == '\0' || strcmp(env, "0") == 0) return;
+	if(strcmp(env, "1") == 0) {
+		snprintf(trace_path, sizeof(trace_path), "%s_trace.json", program);
+	} else {
+		snprintf(trace_path, sizeof(trace_path), "%s", env);
+	}
+	trace_origin_ns = trace_now_ns();
+	trace_enabled = 1;
+	atexit(trace_dump);
+}
+
+// Closes the frame started by the previous call, records its duration
+void trace_frame(long long start_ns) {
+	long long end_ns = trace_now_ns();
+
+	trace_record("frame", 0, start_ns, end_ns);
+	trace_frame_ms[trace_frames % TRACE_FRAMES] = (end_ns - start_ns) / 1e6;
+	if(++trace_frames % TRACE_REPORT == 0) {
+		trace_percentiles();
+	}
+}
+
+#ifdef NO_TRACE
+	#define TRACE_FRAME_BEGIN()
+	#define TRACE_FRAME_END()
+	#define TRACE_BEGIN(var)
+	#define TRACE_END(var, stage, tid)
+#else
+	#define TRACE_FRAME_BEGIN() \
+		long long trace_frame_start_ns = trace_enabled ? trace_now_ns() : 0
+	#define TRACE_FRAME_END() \
+		if(trace_enabled) trace_frame(trace_frame_start_ns)
+	#define TRACE_BEGIN(var) \
+		long long var = trace_enabled ? trace_now_ns() : 0
+	#define TRACE_END(var, stage, tid) \
+		if(trace_enabled) trace_record(stage, tid, var, trace_now_ns())
+#endif
+
+#endif
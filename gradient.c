@@ -10,8 +10,25 @@
 #include <math.h>
 #include <string.h>
 #include <time.h>
-
-#ifdef __APPLE__
+#include <pthread.h>
+#include <stdatomic.h>
+#include <complex.h>
+#include <stdint.h>
+
+#include "frame_trace.h"
+
+#ifdef HEADLESS
+  #include <omp.h>
+  #include <errno.h>
+  #include <dirent.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/wait.h>
+  // Without a window GL is neither included nor linked, only its types are needed
+  typedef unsigned char GLubyte;
+  typedef unsigned int GLuint;
+#elif defined(__APPLE__)
   #include <GLUT/glut.h>
 #else
   #include <GL/freeglut.h>
@@ -28,6 +45,10 @@
 #define DISPLAY_LAYERS 1
 #define DISPLAY_FRACTAL 2
 #define DISPLAY_TO_LESSBIT 3
+#define DISPLAY_CHAIN 4
+
+// Name of the compute stage of each display mode in frame traces
+const char *mode_stage[] = {"effect", "blend", "fractal", "reduce", "chain"};
 
 typedef struct {
     GLubyte r;
@@ -42,6 +63,37 @@ typedef struct {
     GLubyte a;
 } rgba_pix;
 
+typedef void (*frame_fn)(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]);
+typedef void (*point_fn)(int x, pixel *row);
+
+typedef struct {
+	const char *name;
+	frame_fn frame;
+	point_fn point; // NULL if the stage reads neighbours
+	void (*prepare)(pixel src[TEX_SIZE][TEX_SIZE]); // frame statistics needed by point
+} stage;
+
+/*
+ * Everything the keyboard changes. Effects only read settings, which belongs
+ * to the thread computing frames, the GLUT thread edits its own copy and
+ * hands it over under job_lock together with a new job_generation.
+ */
+typedef struct {
+	int mode;
+	stage effect; // Empty until the window sets the starting effect and reducer
+	stage reduce;
+	int alpha_x;
+	unsigned int dither_seed;
+	float gauss_sigma;
+	int adaptive_levels;
+	int ycc_filtering; // Small convolutions run on luminance only
+	int morph_op;
+} frame_settings;
+
+frame_settings settings = {
+	.mode = DISPLAY_EFFECT, .dither_seed = 1, .gauss_sigma = 8.0, .adaptive_levels = 1
+};
+
 pixel image[2*TEX_SIZE][TEX_SIZE];
 
 pixel (*source)[TEX_SIZE] = (pixel(*)[TEX_SIZE])&image[0][0];
@@ -52,43 +104,211 @@ rgba_pix layer1[TEX_SIZE][TEX_SIZE];
 
 rgba_pix layer2[TEX_SIZE][TEX_SIZE];
 
-int alpha_x = 0;
+// Generation of the requested frame, bumped on every keypress
+atomic_int job_generation = 0;
 
-int mode = DISPLAY_EFFECT;
+// Generation the frame worker is computing right now
+int worker_generation = 0;
 
-int reduced = 0;
+// Bumped every time source is loaded or changed, invalidates derived planes
+int source_version = 1;
 
 GLuint texture;
 
-FILE *open_image_file(char *path) {
-	FILE *image_file = fopen(path, "rb");
-	if(image_file == NULL) {
-		printf("Error openning %s\n", path);
-		exit(1);
+// True once the frame being computed was superseded, long kernels stop early
+static inline int job_stale() {
+	return atomic_load_explicit(&job_generation, memory_order_relaxed) != worker_generation;
+}
+
+/*
+ * Separable resampler used to bring images of any size to TEX_SIZE while
+ * loading. Every output column and row has a precomputed table with the
+ * first input sample and the weights of its taps, taps outside the image
+ * are folded onto the edge sample. Rows are filtered horizontally into a
+ * buffer of 4 float pixels and then combined vertically, both passes work
+ * on whole pixels as 4 lane vectors. When shrinking the kernels are widened
+ * by the scale so they average every input sample.
+ */
+#define RESAMPLE_NEAREST 0
+#define RESAMPLE_BILINEAR 1
+#define RESAMPLE_BICUBIC 2
+#define RESAMPLE_LANCZOS 3
+
+typedef float f32x4 __attribute__((vector_size(16)));
+
+typedef struct {
+	int taps;
+	int *first; // first input sample of every output sample
+	float *weights; // taps weights of every output sample
+} resample_table;
+
+const char *resample_names[] = {"nearest", "bilinear", "bicubic", "lanczos"};
+
+int resample_filter = RESAMPLE_LANCZOS;
+
+static const float resample_support[] = {0.5, 1, 2, 3};
+
+static float resample_kernel(int filter, float t) {
+	t = fabsf(t);
+	switch(filter) {
+		case RESAMPLE_BILINEAR:
+			return (t < 1) ? 1 - t : 0;
+		case RESAMPLE_BICUBIC: // Catmull-Rom
+			if(t < 1) return (1.5*t - 2.5)*t*t + 1;
+			if(t < 2) return ((-0.5*t + 2.5)*t - 4)*t + 2;
+			return 0;
+		case RESAMPLE_LANCZOS:
+			if(t < 1e-6) return 1;
+			if(t >= 3) return 0;
+			return 3 * sinf(M_PI * t) * sinf(M_PI * t / 3) / (M_PI * M_PI * t * t);
 	}
-	return image_file;
+	return 0;
 }
 
-void load_rgb(pixel target[TEX_SIZE][TEX_SIZE], char *path, int size) {
-	int x, y;
-	FILE *image_file = open_image_file(path);
-	for(x=0; x<size; x++) {
-		for(y=0; y<size; y++) {
-			fread(&target[x][y], sizeof(pixel), 1, image_file);
+resample_table resample_weights(int in_len, int out_len, int filter) {
+	resample_table table;
+	float scale = (float)in_len / out_len;
+	float widen = (scale > 1 && filter != RESAMPLE_NEAREST) ? scale : 1;
+	float support = resample_support[filter] * widen;
+	int span = (filter == RESAMPLE_NEAREST) ? 1 : (int)ceil(2 * support) + 1;
+	int i, t;
+
+	table.taps = (span < in_len) ? span : in_len;
+	table.first = malloc(out_len * sizeof(int));
+	table.weights = calloc(out_len * table.taps, sizeof(float));
+	for(i = 0; i < out_len; i++) {
+		float center = (i + 0.5) * scale - 0.5, total = 0;
+		float *w = &table.weights[i * table.taps];
+		int start = (filter == RESAMPLE_NEAREST) ? (int)floor(center + 0.5) : (int)floor(center - support) + 1;
+		int first = start;
+
+		if(first > in_len - table.taps) first = in_len - table.taps;
+		if(first < 0) first = 0;
+		table.first[i] = first;
+		for(t = 0; t < span; t++) {
+			int pos = start + t;
+			float weight = (filter == RESAMPLE_NEAREST) ? 1 : resample_kernel(filter, (pos - center) / widen);
+			if(pos < 0) pos = 0;
+			if(pos >= in_len) pos = in_len - 1;
+			w[pos - first] += weight;
+			total += weight;
 		}
+		for(t = 0; t < table.taps; t++) w[t] /= total;
 	}
-	fclose(image_file);
+	return table;
 }
 
-void load_rgba(rgba_pix target[TEX_SIZE][TEX_SIZE], char *path, int size) {
-	int x, y;
-	FILE *image_file = open_image_file(path);
-	for(x=0; x<size; x++) {
-		for(y=0; y<size; y++) {
-			fread(&target[x][y], sizeof(rgba_pix), 1, image_file);
+void resample_free(resample_table *table) {
+	free(table->first);
+	free(table->weights);
+}
+
+// Scales in_w x in_h pixels of channels bytes to out_w x out_h
+void resample(
+	GLubyte *in, int in_w, int in_h,
+	GLubyte *out, int out_w, int out_h,
+	int channels, int filter
+) {
+	resample_table cols = resample_weights(in_w, out_w, filter);
+	resample_table rows = resample_weights(in_h, out_h, filter);
+	f32x4 *wide = malloc((size_t)in_h * out_w * sizeof(f32x4));
+	int x;
+
+	#pragma omp parallel for
+	for(x = 0; x < in_h; x++) {
+		GLubyte *pix = &in[(size_t)x * in_w * channels];
+		f32x4 *line = malloc(in_w * sizeof(f32x4));
+		int y, t;
+		for(y = 0; y < in_w; y++, pix += channels) {
+			line[y] = (f32x4){pix[0], pix[1], pix[2], (channels == 4) ? pix[3] : 0};
+		}
+		for(y = 0; y < out_w; y++) {
+			f32x4 acc = {0, 0, 0, 0};
+			float *w = &cols.weights[y * cols.taps];
+			f32x4 *taps = &line[cols.first[y]];
+			for(t = 0; t < cols.taps; t++) acc += w[t] * taps[t];
+			wide[(size_t)x * out_w + y] = acc;
+		}
+		free(line);
+	}
+
+	#pragma omp parallel for
+	for(x = 0; x < out_h; x++) {
+		f32x4 *acc = calloc(out_w, sizeof(f32x4));
+		float *w = &rows.weights[x * rows.taps];
+		int y, t, c;
+		for(t = 0; t < rows.taps; t++) {
+			f32x4 *line = &wide[(size_t)(rows.first[x] + t) * out_w];
+			for(y = 0; y < out_w; y++) acc[y] += w[t] * line[y];
+		}
+		for(y = 0; y < out_w; y++) {
+			GLubyte *pix = &out[((size_t)x * out_w + y) * channels];
+			for(c = 0; c < channels; c++) {
+				float v = acc[y][c] + 0.5;
+				pix[c] = (v < 0) ? 0 : (v > 255) ? 255 : (GLubyte)v;
+			}
 		}
+		free(acc);
+	}
+
+	free(wide);
+	resample_free(&cols);
+	resample_free(&rows);
+}
+
+/*
+ * Reads a raw image of width x height pixels and scales it to TEX_SIZE, zero
+ * width and height mean a square image with the side taken from the file size.
+ * Returns -1 when the file can not be used, the error is printed.
+ */
+int read_raw(GLubyte *target, char *path, int width, int height, int channels) {
+	FILE *image_file = fopen(path, "rb");
+	GLubyte *data;
+	long length;
+
+	if(image_file == NULL) {
+		fprintf(stderr, "Error openning %s\n", path);
+		return -1;
+	}
+	fseek(image_file, 0, SEEK_END);
+	length = ftell(image_file);
+	rewind(image_file);
+	if(width <= 0 || height <= 0) {
+		width = height = sqrt(length / channels) + 0.5;
+	}
+	if(length < (long)width * height * channels || width == 0) {
+		fprintf(stderr, "Error openning %s, expected %dx%d pixels\n", path, width, height);
+		fclose(image_file);
+		return -1;
+	}
+	data = malloc((size_t)width * height * channels);
+	if(fread(data, channels, width * height, image_file) != width * height) {
+		fprintf(stderr, "Error reading %s\n", path);
+		fclose(image_file);
+		free(data);
+		return -1;
 	}
 	fclose(image_file);
+
+	if(width == TEX_SIZE && height == TEX_SIZE) {
+		memcpy(target, data, TEX_SIZE*TEX_SIZE*channels);
+	} else {
+		resample(data, width, height, target, TEX_SIZE, TEX_SIZE, channels, resample_filter);
+	}
+	free(data);
+	return 0;
+}
+
+void load_raw(GLubyte *target, char *path, int width, int height, int channels) {
+	if(read_raw(target, path, width, height, channels) != 0) exit(1);
+}
+
+void load_rgb(pixel target[TEX_SIZE][TEX_SIZE], char *path, int width, int height) {
+	load_raw(&target[0][0].r, path, width, height, sizeof(pixel));
+}
+
+void load_rgba(rgba_pix target[TEX_SIZE][TEX_SIZE], char *path, int width, int height) {
+	load_raw(&target[0][0].r, path, width, height, sizeof(rgba_pix));
 }
 
 int get_between_0_255(int source) {
@@ -97,7 +317,7 @@ int get_between_0_255(int source) {
 	else return source;
 }
 
-int truncate(int value, int size, int trunc_size) {
+int quantize(int value, int size, int trunc_size) {
 	float scale = (float)size / (float) trunc_size;
 	return round(round(value/scale)*scale);
 }
@@ -140,7 +360,465 @@ void pixel_add(pixel *pixel, int addition) {
 	pixel->b += addition;
 }
 
+/*
+ * Luminance stage shared by all grayscale based reducers.
+ * Weights 0.3, 0.59, 0.11 in 8.8 fixed point (they sum to 256), the plane
+ * is rebuilt only when source_version changes.
+ */
+#define LUMA_R 77
+#define LUMA_G 151
+#define LUMA_B 28
+
+typedef unsigned char u8x16 __attribute__((vector_size(16)));
+typedef unsigned short u16x16 __attribute__((vector_size(32)));
+
+GLubyte luma[TEX_SIZE][TEX_SIZE];
+
+int luma_version = 0;
+
+// Shuffle masks deinterleaving 16 packed rgb pixels (3 vectors) into channels,
+// first from bytes 0..31, then the rest from bytes 32..47
+static const u8x16 luma_mask_lo[3] = {
+	{0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 0, 0, 0, 0, 0},
+	{1, 4, 7, 10, 13, 16, 19, 22, 25, 28, 31, 0, 0, 0, 0, 0},
+	{2, 5, 8, 11, 14, 17, 20, 23, 26, 29, 0, 0, 0, 0, 0, 0}
+};
+
+static const u8x16 luma_mask_hi[3] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 17, 20, 23, 26, 29},
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 18, 21, 24, 27, 30},
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 16, 19, 22, 25, 28, 31}
+};
+
+static inline int luma_of(pixel *pix) {
+	return (LUMA_R * pix->r + LUMA_G * pix->g + LUMA_B * pix->b) >> 8;
+}
+
+// Converts one row of pixels to luminance, 16 pixels per step
+void luma_row(pixel *row, GLubyte *out, int len) {
+	int i, c;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		u8x16 bytes[3], channel[3];
+		u16x16 wide[3], y;
+
+		memcpy(bytes, &row[i], sizeof(bytes));
+		for(c = 0; c < 3; c++) {
+			channel[c] = __builtin_shuffle(
+				__builtin_shuffle(bytes[0], bytes[1], luma_mask_lo[c]),
+				bytes[2], luma_mask_hi[c]
+			);
+			wide[c] = __builtin_convertvector(channel[c], u16x16);
+		}
+		y = (wide[0] * LUMA_R + wide[1] * LUMA_G + wide[2] * LUMA_B) >> 8;
+		channel[0] = __builtin_convertvector(y, u8x16);
+		memcpy(&out[i], &channel[0], sizeof(channel[0]));
+	}
+	for(; i < len; i++) {
+		out[i] = luma_of(&row[i]);
+	}
+}
+
+// Returns luminance plane of src, the plane of source is cached until source changes
+GLubyte (*luma_plane(pixel src[TEX_SIZE][TEX_SIZE]))[TEX_SIZE] {
+	int x;
+
+	if(src != source || luma_version != source_version) {
+		#pragma omp parallel for
+		for(x = 0; x < TEX_SIZE; x++) {
+			luma_row(src[x], luma[x], TEX_SIZE);
+		}
+		luma_version = (src == source) ? source_version : 0;
+	}
+	return luma;
+}
+
+/*
+ * YCbCr working space for the effects that only matter on luminance. Y uses
+ * the luminance weights above, Cb and Cr are the scaled blue and red
+ * differences around 128, all in 16 bit fixed point 16 pixels at a time.
+ * With ycc_filtering the small convolutions run on the Y plane only, which
+ * is a third of the work, and chroma is either kept or set to neutral.
+ */
+#define CHROMA_KEEP 0
+#define CHROMA_NEUTRAL 1
+#define CB_SCALE 72 // 0.564 in 1.7 fixed point
+#define CR_SCALE 91 // 0.713
+#define CB_INVERSE 228 // 1/0.564
+#define CR_INVERSE 180 // 1/0.713
+#define G_FROM_R 65 // LUMA_R / LUMA_G
+#define G_FROM_B 24 // LUMA_B / LUMA_G
+
+typedef short s16x16 __attribute__((vector_size(32)));
+
+typedef struct {
+	GLubyte y[TEX_SIZE][TEX_SIZE];
+	GLubyte cb[TEX_SIZE][TEX_SIZE];
+	GLubyte cr[TEX_SIZE][TEX_SIZE];
+} ycc_image;
+
+ycc_image ycc;
+
+int ycc_version = 0;
+
+
+// Clamps to 0..255 in place, vectors this wide are not passed by value
+static inline void clamp_byte(s16x16 *v) {
+	s16x16 over = *v > 255;
+	*v &= *v > 0;
+	*v = (*v & ~over) | (255 & over);
+}
+
+void rgb_to_ycc_row(pixel *row, GLubyte *y, GLubyte *cb, GLubyte *cr, int len) {
+	int i, c;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		u8x16 bytes[3], channel[3];
+		s16x16 wide[3], luma, blue, red;
+
+		memcpy(bytes, &row[i], sizeof(bytes));
+		for(c = 0; c < 3; c++) {
+			channel[c] = __builtin_shuffle(
+				__builtin_shuffle(bytes[0], bytes[1], luma_mask_lo[c]),
+				bytes[2], luma_mask_hi[c]
+			);
+			wide[c] = __builtin_convertvector(channel[c], s16x16);
+		}
+		luma = (s16x16)(((u16x16)wide[0] * LUMA_R + (u16x16)wide[1] * LUMA_G + (u16x16)wide[2] * LUMA_B) >> 8);
+		blue = 128 + (((wide[2] - luma) * CB_SCALE) >> 7);
+		red = 128 + (((wide[0] - luma) * CR_SCALE) >> 7);
+		clamp_byte(&blue);
+		clamp_byte(&red);
+		channel[0] = __builtin_convertvector(luma, u8x16);
+		channel[1] = __builtin_convertvector(blue, u8x16);
+		channel[2] = __builtin_convertvector(red, u8x16);
+		memcpy(&y[i], &channel[0], 16);
+		memcpy(&cb[i], &channel[1], 16);
+		memcpy(&cr[i], &channel[2], 16);
+	}
+	for(; i < len; i++) {
+		int l = luma_of(&row[i]), v;
+		y[i] = l;
+		v = 128 + (((row[i].b - l) * CB_SCALE) >> 7);
+		cb[i] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+		v = 128 + (((row[i].r - l) * CR_SCALE) >> 7);
+		cr[i] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+	}
+}
+
+void ycc_to_rgb_row(GLubyte *y, GLubyte *cb, GLubyte *cr, pixel *row, int len) {
+	int i, k;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		u8x16 bytes[3];
+		s16x16 luma, red, blue, green;
+		GLubyte out[3][16];
+
+		memcpy(&bytes[0], &y[i], 16);
+		memcpy(&bytes[1], &cb[i], 16);
+		memcpy(&bytes[2], &cr[i], 16);
+		luma = __builtin_convertvector(bytes[0], s16x16);
+		blue = ((__builtin_convertvector(bytes[1], s16x16) - 128) * CB_INVERSE) >> 7;
+		red = ((__builtin_convertvector(bytes[2], s16x16) - 128) * CR_INVERSE) >> 7;
+		green = luma - ((red * G_FROM_R + blue * G_FROM_B) >> 7);
+		red += luma;
+		blue += luma;
+		clamp_byte(&red);
+		clamp_byte(&green);
+		clamp_byte(&blue);
+		bytes[0] = __builtin_convertvector(red, u8x16);
+		bytes[1] = __builtin_convertvector(green, u8x16);
+		bytes[2] = __builtin_convertvector(blue, u8x16);
+		memcpy(out, bytes, sizeof(out));
+		for(k = 0; k < 16; k++) {
+			row[i + k].r = out[0][k];
+			row[i + k].g = out[1][k];
+			row[i + k].b = out[2][k];
+		}
+	}
+	for(; i < len; i++) {
+		int blue = ((cb[i] - 128) * CB_INVERSE) >> 7;
+		int red = ((cr[i] - 128) * CR_INVERSE) >> 7;
+		int green = -((red * G_FROM_R + blue * G_FROM_B) >> 7);
+		set_pixel_color(&row[i], get_between_0_255(y[i] + red),
+			get_between_0_255(y[i] + green), get_between_0_255(y[i] + blue));
+	}
+}
+
+// Returns YCbCr planes of src, the planes of source are cached until it changes
+ycc_image *ycc_planes(pixel src[TEX_SIZE][TEX_SIZE]) {
+	int x;
+
+	if(src != source || ycc_version != source_version) {
+		#pragma omp parallel for
+		for(x = 0; x < TEX_SIZE; x++) {
+			rgb_to_ycc_row(src[x], ycc.y[x], ycc.cb[x], ycc.cr[x], TEX_SIZE);
+		}
+		ycc_version = (src == source) ? source_version : 0;
+	}
+	return &ycc;
+}
+
+/*
+ * Kernels of the direct path compiled into tap programs. Zero taps are
+ * dropped and taps with the same weight form one group: an integer weight
+ * sums the group and multiplies once (a shift for powers of two, a plain add
+ * or subtract for 1 and -1), a weight of 1/2^n rounds every tap with an add
+ * and a shift, any other weight reads round(value * weight) from a table.
+ * Every tap is rounded like in convolution_transform, so results do not
+ * change. Near the border taps outside the image are skipped like there.
+ * A kernel is compiled the first time it is used and kept for later frames.
+ */
+#define TAP_MAX 64 //Nonzero taps of a compiled kernel, bigger kernels stay generic
+#define TAP_PROGRAMS 32 //Distinct kernels kept compiled
+
+#define TAP_MUL 0 //Sum of the group times weight
+#define TAP_SHIFT 1 //Sum of the group shifted left, times sign
+#define TAP_HALVE 2 //Every tap (v + half) >> shift, times sign
+#define TAP_LUT 3 //Every tap read from lut
+
+typedef struct {
+	int op;
+	int weight; //TAP_MUL
+	int sign; //TAP_SHIFT, TAP_HALVE
+	int shift; //TAP_SHIFT, TAP_HALVE
+	int *lut; //TAP_LUT, round(v * weight) for v 0..255
+	int first, count; //Taps of the group in tap_program.offsets
+} tap_group;
+
+typedef struct {
+	float *kernel; //Copy of the weights the program was compiled from
+	int kernel_size;
+	float bias;
+	int bias_sum; //Bias of all taps, zero taps included
+	int groups;
+	tap_group group[TAP_MAX];
+	int offsets[TAP_MAX]; //Tap position relative to the center, in pixels
+	int tap_x[TAP_MAX], tap_y[TAP_MAX]; //The same position as x and y
+} tap_program;
+
+tap_program tap_programs[TAP_PROGRAMS];
+int tap_program_count = 0;
+pthread_mutex_t tap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tap_classify(tap_group *group, float weight) {
+	float size = fabsf(weight);
+	int exponent, v;
+
+	group->sign = (weight < 0) ? -1 : 1;
+	if(size == (int)size && size < (1 << 16)) {
+		int k = size;
+		if((k & (k - 1)) == 0) {
+			group->op = TAP_SHIFT;
+			for(group->shift = 0; (1 << group->shift) < k; group->shift++);
+		} else {
+			group->op = TAP_MUL;
+			group->weight = weight;
+		}
+	} else if(frexpf(size, &exponent) == 0.5f && exponent <= 0 && exponent > -15) {
+		group->op = TAP_HALVE;
+		group->shift = 1 - exponent;
+	} else {
+		group->op = TAP_LUT;
+		group->lut = malloc(256 * sizeof(int));
+		for(v = 0; v < 256; v++) group->lut[v] = round(v * weight);
+	}
+}
+
+static void tap_build(tap_program *program, float *kernel, int kernel_size, float bias) {
+	int taps = kernel_size * kernel_size, half = kernel_size / 2;
+	int t, u, n = 0;
+
+	program->kernel = malloc(taps * sizeof(float));
+	memcpy(program->kernel, kernel, taps * sizeof(float));
+	program->kernel_size = kernel_size;
+	program->bias = bias;
+	program->bias_sum = bias * taps;
+	program->groups = 0;
+	for(t = 0; t < taps; t++) {
+		tap_group *group;
+		if(kernel[t] == 0) continue;
+		for(u = 0; u < t && kernel[u] != kernel[t]; u++);
+		if(u < t) continue;
+		group = &program->group[program->groups++];
+		group->first = n;
+		for(u = t; u < taps; u++) {
+			if(kernel[u] != kernel[t]) continue;
+			program->tap_x[n] = u / kernel_size - half;
+			program->tap_y[n] = u % kernel_size - half;
+			program->offsets[n] = program->tap_x[n] * TEX_SIZE + program->tap_y[n];
+			n++;
+		}
+		group->count = n - group->first;
+		tap_classify(group, kernel[t]);
+	}
+}
+
+// Program of the kernel, compiled on first use, NULL if it has to stay generic
+tap_program *tap_compile(float *kernel, int kernel_size, float bias) {
+	int taps = kernel_size * kernel_size;
+	tap_program *program = NULL;
+	int i, nonzero = 0;
+
+	// A fractional bias truncates the sum after every tap, keep that exact
+	if(bias != (int)bias) return NULL;
+	for(i = 0; i < taps; i++) nonzero += (kernel[i] != 0);
+	if(nonzero > TAP_MAX) return NULL;
+
+	pthread_mutex_lock(&tap_lock);
+	for(i = 0; i < tap_program_count; i++) {
+		tap_program *p = &tap_programs[i];
+		if(p->kernel_size == kernel_size && p->bias == bias
+			&& memcmp(p->kernel, kernel, taps * sizeof(float)) == 0) {
+			program = p;
+			break;
+		}
+	}
+	if(program == NULL && tap_program_count < TAP_PROGRAMS) {
+		program = &tap_programs[tap_program_count];
+		tap_build(program, kernel, kernel_size, bias);
+		tap_program_count++;
+	}
+	pthread_mutex_unlock(&tap_lock);
+	return program;
+}
+
+// Runs the program on one channel, stride is the distance of two pixels in bytes
+static inline int tap_sum(tap_program *program, GLubyte *center, int stride) {
+	int sum = program->bias_sum;
+	int g, t;
+
+	for(g = 0; g < program->groups; g++) {
+		tap_group *group = &program->group[g];
+		int *offset = &program->offsets[group->first];
+		int part = 0;
+
+		if(group->op == TAP_LUT) {
+			for(t = 0; t < group->count; t++) part += group->lut[center[offset[t] * stride]];
+		} else if(group->op == TAP_HALVE) {
+			int round_half = 1 << (group->shift - 1);
+			for(t = 0; t < group->count; t++) part += (center[offset[t] * stride] + round_half) >> group->shift;
+			part *= group->sign;
+		} else {
+			for(t = 0; t < group->count; t++) part += center[offset[t] * stride];
+			if(group->op == TAP_SHIFT) part = (part << group->shift) * group->sign;
+			else part *= group->weight;
+		}
+		sum += part;
+	}
+	return sum;
+}
+
+// Number of kernel taps along one axis that land inside the image
+static inline int taps_inside(int pos, int half) {
+	int from = (pos - half < 0) ? 0 : pos - half;
+	int to = (pos + half >= TEX_SIZE) ? TEX_SIZE - 1 : pos + half;
+	return to - from + 1;
+}
+
+// One tap of a group on its own, for pixels where some taps are skipped
+static inline int tap_value(tap_group *group, int v) {
+	switch(group->op) {
+	case TAP_LUT: return group->lut[v];
+	case TAP_HALVE: return ((v + (1 << (group->shift - 1))) >> group->shift) * group->sign;
+	case TAP_SHIFT: return (v << group->shift) * group->sign;
+	default: return v * group->weight;
+	}
+}
+
+// Program on one channel of a pixel near the border, plane points to the
+// channel of the first pixel, bias counts every tap inside the image
+static int tap_edge_sum(tap_program *program, GLubyte *plane, int stride, int x, int y) {
+	int half = program->kernel_size / 2;
+	int sum = program->bias * taps_inside(x, half) * taps_inside(y, half);
+	int g, t;
+
+	for(g = 0; g < program->groups; g++) {
+		tap_group *group = &program->group[g];
+		for(t = group->first; t < group->first + group->count; t++) {
+			int nx = x + program->tap_x[t], ny = y + program->tap_y[t];
+			if(nx < 0 || nx >= TEX_SIZE || ny < 0 || ny >= TEX_SIZE) continue;
+			sum += tap_value(group, plane[(nx * TEX_SIZE + ny) * stride]);
+		}
+	}
+	return sum;
+}
+
+void tap_border(tap_program *program, pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE], int x, int y) {
+	GLubyte *plane = &src[0][0].r;
+
+	set_color(dst, x, y,
+		tap_edge_sum(program, plane, sizeof(pixel), x, y),
+		tap_edge_sum(program, plane + 1, sizeof(pixel), x, y),
+		tap_edge_sum(program, plane + 2, sizeof(pixel), x, y));
+}
+
+/*
+ * Convolution of the Y plane with the same rounding as the RGB path, every
+ * tap is a table of round(value * weight) + bias so a pixel is a sum of
+ * lookups, taps outside the image are skipped. Kernels with a tap program
+ * run it instead and need no tables.
+ */
+void luma_convolution(
+	pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE],
+	float *kernel, int kernel_size, float bias, int chroma
+) {
+	static GLubyte filtered[TEX_SIZE][TEX_SIZE];
+	static GLubyte neutral[TEX_SIZE];
+	ycc_image *planes = ycc_planes(src);
+	tap_program *program = tap_compile(kernel, kernel_size, bias);
+	int half = kernel_size / 2, taps = kernel_size * kernel_size;
+	int (*tap_lut)[256] = NULL;
+	int x, t, v;
+
+	if(program == NULL) {
+		tap_lut = malloc(taps * sizeof(*tap_lut));
+		for(t = 0; t < taps; t++) {
+			for(v = 0; v < 256; v++) tap_lut[t][v] = round(v * kernel[t]) + bias;
+		}
+	}
+	memset(neutral, 128, sizeof(neutral));
+
+	#pragma omp parallel for
+	for(x = 0; x < TEX_SIZE; x++) {
+		int y, kx, ky;
+		for(y = 0; y < TEX_SIZE; y++) {
+			int inside = x >= half && x < TEX_SIZE - half && y >= half && y < TEX_SIZE - half;
+			int sum = 0;
+			if(program != NULL && inside) {
+				sum = tap_sum(program, &planes->y[x][y], 1);
+			} else if(program != NULL) {
+				sum = tap_edge_sum(program, &planes->y[0][0], 1, x, y);
+			} else if(inside) {
+				for(kx = 0, t = 0; kx < kernel_size; kx++) {
+					GLubyte *line = &planes->y[x - half + kx][y - half];
+					for(ky = 0; ky < kernel_size; ky++, t++) sum += tap_lut[t][line[ky]];
+				}
+			} else {
+				for(kx = 0; kx < kernel_size; kx++) {
+					int nx = x - half + kx;
+					if(nx < 0 || nx >= TEX_SIZE) continue;
+					for(ky = 0; ky < kernel_size; ky++) {
+						int ny = y - half + ky;
+						if(ny < 0 || ny >= TEX_SIZE) continue;
+						sum += tap_lut[kx * kernel_size + ky][planes->y[nx][ny]];
+					}
+				}
+			}
+			filtered[x][y] = get_between_0_255(sum);
+		}
+		if(chroma == CHROMA_KEEP) {
+			ycc_to_rgb_row(filtered[x], planes->cb[x], planes->cr[x], dst[x], TEX_SIZE);
+		} else {
+			ycc_to_rgb_row(filtered[x], neutral, neutral, dst[x], TEX_SIZE);
+		}
+	}
+	free(tap_lut);
+}
+
 void convolution_transform(
+	pixel src[TEX_SIZE][TEX_SIZE],
+	pixel dst[TEX_SIZE][TEX_SIZE],
 	int pixel_x, int pixel_y, 
 	float *kernel, 
 	int kernel_half_size, 
@@ -157,40 +835,248 @@ void convolution_transform(
 					int kernel_p = (x - pixel_x + kernel_half_size) * kernel_size;
 					kernel_p += (y - pixel_y + kernel_half_size);
 
-					red += round(source[x][y].r*kernel[kernel_p])+bias;
-					green += round(source[x][y].g*kernel[kernel_p])+bias;
-					blue += round(source[x][y].b*kernel[kernel_p])+bias;
+					red += round(src[x][y].r*kernel[kernel_p])+bias;
+					green += round(src[x][y].g*kernel[kernel_p])+bias;
+					blue += round(src[x][y].b*kernel[kernel_p])+bias;
 
 				}
 			}
 		}
 	}
 
-	set_color(result, pixel_x, pixel_y, red, green, blue);
+	set_color(dst, pixel_x, pixel_y, red, green, blue);
 }
 
-void convolution(float *kernel, int kernel_size, float bias) {
+// Direct convolution of rows from..to-1, interior pixels run the compiled taps
+void convolution_rows(
+	pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE],
+	float *kernel, int kernel_size, float bias, int from, int to
+) {
 	int x, y;
 	int kernel_half_size = floor(kernel_size/2);
+	tap_program *program = tap_compile(kernel, kernel_size, bias);
 
-	for(x = 0; x < TEX_SIZE; x++) {
-		for(y = 0; y < TEX_SIZE; y++) {
-			convolution_transform(x, y, kernel, kernel_half_size, kernel_size, bias);
+	for(x = from; x < to; x++) {
+		if(job_stale()) return;
+		if(program == NULL) {
+			for(y = 0; y < TEX_SIZE; y++) {
+				convolution_transform(src, dst, x, y, kernel, kernel_half_size, kernel_size, bias);
+			}
+			continue;
+		}
+		if(x < kernel_half_size || x >= TEX_SIZE - kernel_half_size) {
+			for(y = 0; y < TEX_SIZE; y++) tap_border(program, src, dst, x, y);
+			continue;
+		}
+		for(y = 0; y < kernel_half_size; y++) tap_border(program, src, dst, x, y);
+		for(; y < TEX_SIZE - kernel_half_size; y++) {
+			GLubyte *center = &src[x][y].r;
+			set_pixel_color(&dst[x][y],
+				tap_sum(program, center, sizeof(pixel)),
+				tap_sum(program, center + 1, sizeof(pixel)),
+				tap_sum(program, center + 2, sizeof(pixel)));
+		}
+		for(; y < TEX_SIZE; y++) tap_border(program, src, dst, x, y);
+	}
+}
+
+/*
+ * Frequency domain convolution for large kernels. The image is cut into
+ * n x n tiles overlapping by kernel_size-1 (overlap-save), each tile is
+ * transformed, multiplied by the spectrum of the kernel and transformed
+ * back. Pixels outside the image are zero, like the taps skipped by the
+ * direct path, and bias is added once per tap that falls inside the image.
+ * The sum is rounded once instead of per tap, so the path is only used for
+ * kernels where that gives the same image (see fft_exact).
+ */
+#define FFT_MIN_TILE 64
+#define FFT_MAX_SUM (1 << 20) //Bound of a sum the double transform keeps exact
+
+typedef double complex cpx;
+
+// In place iterative radix-2 FFT of n values (power of two) spaced by stride
+void fft(cpx *data, int n, int stride, int inverse) {
+	int i, j, len, bit;
+
+	for(i = 1, j = 0; i < n; i++) {
+		for(bit = n >> 1; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if(i < j) {
+			cpx tmp = data[i*stride];
+			data[i*stride] = data[j*stride];
+			data[j*stride] = tmp;
+		}
+	}
+	for(len = 2; len <= n; len <<= 1) {
+		double angle = (inverse ? 2 : -2) * M_PI / len;
+		cpx step = cos(angle) + sin(angle) * I;
+		for(i = 0; i < n; i += len) {
+			cpx w = 1;
+			for(j = 0; j < len / 2; j++) {
+				cpx a = data[(i + j)*stride];
+				cpx b = data[(i + j + len/2)*stride] * w;
+				data[(i + j)*stride] = a + b;
+				data[(i + j + len/2)*stride] = a - b;
+				w *= step;
+			}
+		}
+	}
+}
+
+// 2D FFT of a n x n tile, unscaled in both directions
+void fft2d(cpx *tile, int n, int inverse) {
+	int i;
+	for(i = 0; i < n; i++) fft(&tile[i*n], n, 1, inverse);
+	for(i = 0; i < n; i++) fft(&tile[i], n, n, inverse);
+}
+
+void convolution_fft(
+	pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE],
+	float *kernel, int kernel_size, float bias
+) {
+	int half = kernel_size / 2;
+	int n = FFT_MIN_TILE;
+	int step, tiles, t, i, j;
+	cpx *spectrum;
+
+	while(n < 2 * kernel_size) n *= 2;
+	step = n - kernel_size + 1;
+	tiles = (TEX_SIZE + step - 1) / step;
+
+	// Kernel flipped so that circular convolution gives the direct path sums
+	spectrum = calloc(n * n, sizeof(cpx));
+	for(i = 0; i < kernel_size; i++) {
+		for(j = 0; j < kernel_size; j++) {
+			spectrum[i*n + j] = kernel[(kernel_size-1-i)*kernel_size + (kernel_size-1-j)];
+		}
+	}
+	fft2d(spectrum, n, 0);
+
+	#pragma omp parallel
+	{
+		// Tile buffers of this thread, red and green share one complex transform
+		// as real and imaginary part
+		cpx *rg = malloc(n * n * sizeof(cpx));
+		cpx *b = malloc(n * n * sizeof(cpx));
+
+		#pragma omp for schedule(dynamic)
+		for(t = 0; t < tiles * tiles; t++) {
+			int tile_x = (t / tiles) * step, tile_y = (t % tiles) * step;
+			double scale = 1.0 / (n * n);
+			int a, c;
+
+			if(job_stale()) continue;
+			for(a = 0; a < n; a++) {
+				int x = tile_x - half + a;
+				for(c = 0; c < n; c++) {
+					int y = tile_y - half + c;
+					if(x >= 0 && x < TEX_SIZE && y >= 0 && y < TEX_SIZE) {
+						rg[a*n + c] = src[x][y].r + src[x][y].g * I;
+						b[a*n + c] = src[x][y].b;
+					} else {
+						rg[a*n + c] = b[a*n + c] = 0;
+					}
+				}
+			}
+			fft2d(rg, n, 0);
+			fft2d(b, n, 0);
+			for(a = 0; a < n * n; a++) {
+				rg[a] *= spectrum[a];
+				b[a] *= spectrum[a];
+			}
+			fft2d(rg, n, 1);
+			fft2d(b, n, 1);
+
+			for(a = kernel_size - 1; a < n && tile_x + a - (kernel_size-1) < TEX_SIZE; a++) {
+				int x = tile_x + a - (kernel_size-1);
+				for(c = kernel_size - 1; c < n && tile_y + c - (kernel_size-1) < TEX_SIZE; c++) {
+					int y = tile_y + c - (kernel_size-1);
+					float tap_bias = bias * taps_inside(x, half) * taps_inside(y, half);
+					set_color(dst, x, y,
+						round(creal(rg[a*n + c]) * scale + tap_bias),
+						round(cimag(rg[a*n + c]) * scale + tap_bias),
+						round(creal(b[a*n + c]) * scale + tap_bias)
+					);
+				}
+			}
 		}
+		free(rg);
+		free(b);
+	}
+	free(spectrum);
+}
+
+/*
+ * Direct or FFT path is chosen per kernel size by timing them. The first
+ * time a size is seen the direct path is timed on a strip of rows from the
+ * middle (border rows skip taps and run the bounds checked loop) and the
+ * FFT path on the whole image (its result is kept), later calls run
+ * the faster one. Both give the same image, so the choice (which depends
+ * on the machine and its load) only changes the speed.
+ */
+#define FFT_PROBE_ROWS 8
+#define FFT_MAX_KERNEL 127
+
+int fft_choice[FFT_MAX_KERNEL + 1]; // 0 not measured yet, 1 direct, 2 fft
+
+/*
+ * The direct path rounds every tap, FFT only the sum. They agree when no
+ * tap needs rounding (integer weights and bias) and the sum is small enough
+ * that the error of the double transform stays far below one half.
+ */
+int fft_exact(float *kernel, int kernel_size, float bias) {
+	double total = fabs(bias) * kernel_size * kernel_size;
+	int t;
+
+	if(bias != rint(bias)) return 0;
+	for(t = 0; t < kernel_size * kernel_size; t++) {
+		if(kernel[t] != rint(kernel[t])) return 0;
+		total += 255 * fabs(kernel[t]);
+	}
+	return total < FFT_MAX_SUM;
+}
+
+static double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void convolution(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE], float *kernel, int kernel_size, float bias) {
+	double start, direct_ms, fft_ms;
+
+	if(kernel_size > FFT_MAX_KERNEL || fft_choice[kernel_size] == 1 || !fft_exact(kernel, kernel_size, bias)) {
+		convolution_rows(src, dst, kernel, kernel_size, bias, 0, TEX_SIZE);
+		return;
+	}
+	if(fft_choice[kernel_size] == 2) {
+		convolution_fft(src, dst, kernel, kernel_size, bias);
+		return;
+	}
+
+	start = now_ms();
+	convolution_rows(src, dst, kernel, kernel_size, bias, TEX_SIZE / 2, TEX_SIZE / 2 + FFT_PROBE_ROWS);
+	direct_ms = (now_ms() - start) * TEX_SIZE / FFT_PROBE_ROWS;
+	start = now_ms();
+	convolution_fft(src, dst, kernel, kernel_size, bias);
+	fft_ms = now_ms() - start;
+
+	if(!job_stale()) {
+		fft_choice[kernel_size] = (fft_ms < direct_ms) ? 2 : 1;
 	}
 }
 
-void blur() {
+void blur(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	float kernel[3][3] = {
 		{ (1.0/9.0), (1.0/9.0), (1.0/9.0) },
 		{ (1.0/9.0), (1.0/9.0), (1.0/9.0) },
 		{ (1.0/9.0), (1.0/9.0), (1.0/9.0) }
 	};
 
-	convolution((float*)&kernel, 3, 0);
+	convolution(src, dst, (float*)&kernel, 3, 0);
 }
 
-void blur5x() {
+void blur5x(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	float kernel[5][5] = {
 		{ (1.0/25.0), (1.0/25.0), (1.0/25.0), (1.0/25.0), (1.0/25.0) },
 		{ (1.0/25.0), (1.0/25.0), (1.0/25.0), (1.0/25.0), (1.0/25.0) },
@@ -199,52 +1085,197 @@ void blur5x() {
 		{ (1.0/25.0), (1.0/25.0), (1.0/25.0), (1.0/25.0), (1.0/25.0) }
 	};
 
-	convolution((float*)&kernel, 5, 0);
+	convolution(src, dst, (float*)&kernel, 5, 0);
 }
 
-void edge_detection1() {
+void edge_detection1(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	float kernel[3][3] = {
 		{ 1, 0,-1},
 		{ 0, 0, 0},
 		{-1, 0, 1}
 	};
 
-	convolution((float*) kernel, 3, 0);
+	if(settings.ycc_filtering) {
+		luma_convolution(src, dst, (float*) kernel, 3, 0, CHROMA_NEUTRAL);
+		return;
+	}
+	convolution(src, dst, (float*) kernel, 3, 0);
 }
 
-void edge_detection3() {
+void edge_detection3(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	float kernel[3][3] = {
 		{-1,-1,-1},
 		{-1, 8,-1},
 		{-1,-1,-1}
 	};
 
-	convolution((float*)kernel, 3, 0);
+	if(settings.ycc_filtering) {
+		luma_convolution(src, dst, (float*)kernel, 3, 0, CHROMA_NEUTRAL);
+		return;
+	}
+	convolution(src, dst, (float*)kernel, 3, 0);
 }
 
-void sharpen() {
+void sharpen(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	float kernel[3][3] = {
 		{ 0,-1, 0},
 		{-1, 5,-1},
 		{ 0,-1, 0}
 	};
 
-	convolution((float*) kernel, 3, 0);
+	if(settings.ycc_filtering) {
+		luma_convolution(src, dst, (float*) kernel, 3, 0, CHROMA_KEEP);
+		return;
+	}
+	convolution(src, dst, (float*) kernel, 3, 0);
 }
 
-void emboss() {
+void emboss(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	float kernel[3][3] = {
 		{ (-1.0/2.0), (-1.0/2.0),      0.0  },
 		{ (-1.0/2.0),         0 , (1.0/2.0) },
 		{         0 , ( 1.0/2.0), (1.0/2.0) }
 	};
 
-	convolution((float*) kernel, 3, 2);
+	if(settings.ycc_filtering) {
+		luma_convolution(src, dst, (float*) kernel, 3, 2, CHROMA_NEUTRAL);
+		return;
+	}
+	convolution(src, dst, (float*) kernel, 3, 2);
+}
+
+// 21x21 diagonal motion blur, large enough to run through the FFT path
+void motion_blur(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	float kernel[21][21];
+	int i;
+
+	memset(kernel, 0, sizeof(kernel));
+	for(i = 0; i < 21; i++) {
+		kernel[i][i] = 1.0/21.0;
+	}
+
+	convolution(src, dst, (float*) kernel, 21, 0);
+}
+
+/*
+ * Gaussian blur of any sigma with the recursive filter of Young and van Vliet.
+ * Every row and column is filtered forwards and backwards by a 3rd order IIR,
+ * so the cost per pixel does not depend on sigma. Filtering runs along the
+ * first index for all columns at once (the inner loop is contiguous and
+ * vectorizes), the other direction is done on a transposed plane.
+ */
+#define IIR_BLOCK 64
+
+typedef struct {
+	float b; // input gain B
+	float a1, a2, a3; // feedback b1/b0, b2/b0, b3/b0
+} iir_coefs;
+
+iir_coefs iir_gauss_coefs(float sigma) {
+	iir_coefs k;
+	double q, b0, b1, b2, b3;
+
+	if(sigma < 0.5) sigma = 0.5;
+	if(sigma >= 2.5) {
+		q = 0.98711 * sigma - 0.96330;
+	} else {
+		q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+	}
+	b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+	b1 = 2.44413*q + 2.85619*q*q + 1.26661*q*q*q;
+	b2 = -(1.4281*q*q + 1.26661*q*q*q);
+	b3 = 0.422205*q*q*q;
+
+	k.b = 1 - (b1 + b2 + b3) / b0;
+	k.a1 = b1 / b0;
+	k.a2 = b2 / b0;
+	k.a3 = b3 / b0;
+	return k;
+}
+
+// Filters plane along x for columns from..to-1, edges are extended
+void iir_columns(float plane[TEX_SIZE][TEX_SIZE], iir_coefs k, int from, int to) {
+	int x, y;
+
+	// forward, the three previous rows start as copies of the first one
+	for(x = 0; x < TEX_SIZE; x++) {
+		float *p1 = plane[x > 0 ? x-1 : 0];
+		float *p2 = plane[x > 1 ? x-2 : 0];
+		float *p3 = plane[x > 2 ? x-3 : 0];
+		for(y = from; y < to; y++) {
+			plane[x][y] = k.b * plane[x][y] + k.a1 * p1[y] + k.a2 * p2[y] + k.a3 * p3[y];
+		}
+	}
+	// backward
+	for(x = TEX_SIZE - 1; x >= 0; x--) {
+		float *n1 = plane[x < TEX_SIZE-1 ? x+1 : TEX_SIZE-1];
+		float *n2 = plane[x < TEX_SIZE-2 ? x+2 : TEX_SIZE-1];
+		float *n3 = plane[x < TEX_SIZE-3 ? x+3 : TEX_SIZE-1];
+		for(y = from; y < to; y++) {
+			plane[x][y] = k.b * plane[x][y] + k.a1 * n1[y] + k.a2 * n2[y] + k.a3 * n3[y];
+		}
+	}
+}
+
+void transpose_plane(float in[TEX_SIZE][TEX_SIZE], float out[TEX_SIZE][TEX_SIZE]) {
+	int bx;
+	#pragma omp parallel for
+	for(bx = 0; bx < TEX_SIZE; bx += 32) {
+		int by, x, y;
+		for(by = 0; by < TEX_SIZE; by += 32) {
+			for(x = bx; x < bx + 32; x++) {
+				for(y = by; y < by + 32; y++) {
+					out[y][x] = in[x][y];
+				}
+			}
+		}
+	}
+}
+
+void iir_plane(float plane[TEX_SIZE][TEX_SIZE], float tmp[TEX_SIZE][TEX_SIZE], iir_coefs k) {
+	int block;
+
+	#pragma omp parallel for
+	for(block = 0; block < TEX_SIZE; block += IIR_BLOCK) {
+		iir_columns(plane, k, block, block + IIR_BLOCK);
+	}
+	transpose_plane(plane, tmp);
+	#pragma omp parallel for
+	for(block = 0; block < TEX_SIZE; block += IIR_BLOCK) {
+		iir_columns(tmp, k, block, block + IIR_BLOCK);
+	}
+	transpose_plane(tmp, plane);
 }
 
-void (*effect)() = sharpen;
+void gaussian_blur(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	static float planes[3][TEX_SIZE][TEX_SIZE];
+	static float tmp[TEX_SIZE][TEX_SIZE];
+	iir_coefs k = iir_gauss_coefs(settings.gauss_sigma);
+	int x, y, c;
+
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			planes[C_RED][x][y] = src[x][y].r;
+			planes[C_GREEN][x][y] = src[x][y].g;
+			planes[C_BLUE][x][y] = src[x][y].b;
+		}
+	}
+	for(c = 0; c < 3; c++) {
+		if(job_stale()) return;
+		iir_plane(planes[c], tmp, k);
+	}
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			set_color(dst, x, y,
+				round(planes[C_RED][x][y]),
+				round(planes[C_GREEN][x][y]),
+				round(planes[C_BLUE][x][y])
+			);
+		}
+	}
+}
 
-void print_fractal() {
+void print_fractal(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 
 	#define MaxIters 400
 	#define LEFT     -2.0
@@ -257,6 +1288,7 @@ void print_fractal() {
 	long double rsquared, isquared;
 
 	for (y = 0; y < TEX_SIZE; y++) {
+		if(job_stale()) return;
 		for (x = 0; x < TEX_SIZE; x++) {
 			zr = 0.0;
 			zi = 0.0;
@@ -276,106 +1308,574 @@ void print_fractal() {
 				isquared = zi * zi;
 			}
 			if (rsquared + isquared <= 4.0)
-				set_color(result,x,y,50,50,50);
+				set_color(dst,x,y,50,50,50);
 			else
-				set_color(result,x,y,0,0,0);
+				set_color(dst,x,y,0,0,0);
 		}
 	}
 }
 
-void to_3bit() {
-	int x, y;
+/*
+ * Histogram engine for the effects that adapt to image statistics.
+ * Every thread counts its rows into private bins, four copies per channel
+ * used round robin so neighbouring pixels of the same value do not wait on
+ * each other's increment, and the copies are summed at the end.
+ * Histograms of source are cached like its luminance plane.
+ */
+#define C_LUMA 3
+#define HIST_LANES 4
+
+typedef struct {
+	unsigned int bins[4][256]; // C_RED, C_GREEN, C_BLUE and C_LUMA
+	int count;
+} image_hist;
+
+image_hist source_hist;
+
+int hist_version = 0;
+
+// Adds len pixels and their luminance to lanes[lane][channel]
+static void hist_row(pixel *row, GLubyte *lum, unsigned int lanes[HIST_LANES][4][256], int len) {
+	int y, lane;
+	for(y = 0; y + HIST_LANES <= len; y += HIST_LANES) {
+		for(lane = 0; lane < HIST_LANES; lane++) {
+			lanes[lane][C_RED][row[y + lane].r]++;
+			lanes[lane][C_GREEN][row[y + lane].g]++;
+			lanes[lane][C_BLUE][row[y + lane].b]++;
+			lanes[lane][C_LUMA][lum[y + lane]]++;
+		}
+	}
+	for(; y < len; y++) {
+		lanes[0][C_RED][row[y].r]++;
+		lanes[0][C_GREEN][row[y].g]++;
+		lanes[0][C_BLUE][row[y].b]++;
+		lanes[0][C_LUMA][lum[y]]++;
+	}
+}
+
+void image_histogram(pixel src[TEX_SIZE][TEX_SIZE], image_hist *hist) {
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
+
+	memset(hist, 0, sizeof(*hist));
+	hist->count = TEX_SIZE * TEX_SIZE;
+	#pragma omp parallel
+	{
+		unsigned int lanes[HIST_LANES][4][256];
+		int x, lane, c, v;
+
+		memset(lanes, 0, sizeof(lanes));
+		#pragma omp for nowait
+		for(x = 0; x < TEX_SIZE; x++) {
+			hist_row(src[x], lum[x], lanes, TEX_SIZE);
+		}
+		for(lane = 1; lane < HIST_LANES; lane++) {
+			for(c = 0; c < 4; c++) {
+				for(v = 0; v < 256; v++) lanes[0][c][v] += lanes[lane][c][v];
+			}
+		}
+		#pragma omp critical
+		for(c = 0; c < 4; c++) {
+			for(v = 0; v < 256; v++) hist->bins[c][v] += lanes[0][c][v];
+		}
+	}
+}
+
+// Returns histograms of src, the ones of source are rebuilt only when it changes
+image_hist *frame_histogram(pixel src[TEX_SIZE][TEX_SIZE]) {
+	static image_hist other;
+
+	if(src != source) {
+		image_histogram(src, &other);
+		return &other;
+	}
+	if(hist_version != source_version) {
+		image_histogram(src, &source_hist);
+		hist_version = source_version;
+	}
+	return &source_hist;
+}
+
+// Otsu's threshold, the level maximizing variance between the two classes
+int otsu_level(unsigned int *bins, int count) {
+	double sum = 0, sum_low = 0, best = -1;
+	int weight_low = 0, level = 127, v;
+
+	for(v = 0; v < 256; v++) sum += (double)v * bins[v];
+	for(v = 0; v < 255; v++) {
+		int weight_high;
+		double mean_low, mean_high, between;
+		weight_low += bins[v];
+		sum_low += (double)v * bins[v];
+		weight_high = count - weight_low;
+		if(weight_low == 0) continue;
+		if(weight_high == 0) break;
+		mean_low = sum_low / weight_low;
+		mean_high = (sum - sum_low) / weight_high;
+		between = (double)weight_low * weight_high * (mean_low - mean_high) * (mean_low - mean_high);
+		if(between > best) {
+			best = between;
+			level = v;
+		}
+	}
+	return level;
+}
+
+// Lowest level with more than fraction of pixels at or below it
+int hist_percentile(unsigned int *bins, int count, double fraction) {
+	int limit = count * fraction, seen = 0, v;
+	for(v = 0; v < 255; v++) {
+		seen += bins[v];
+		if(seen > limit) break;
+	}
+	return v;
+}
+
+/*
+ * Thresholds of the 1-bit and 3-bit reducers, values above the level turn
+ * white. Adaptive levels come from Otsu's method on the reducer's input,
+ * fixed ones are the old constants (channel > 125, 3 * luma > 380, and
+ * 3 * luma > 335 for ordered dithering).
+ */
+#define ORDERED_BIAS 15
+
+typedef struct {
+	int channel[3];
+	int luma;
+	int ordered;
+} reduce_levels;
+
+reduce_levels levels = {{125, 125, 125}, 126, 111};
+
+void update_levels(pixel src[TEX_SIZE][TEX_SIZE]) {
+	image_hist *hist;
+	int c;
+
+	if(!settings.adaptive_levels) {
+		levels = (reduce_levels){{125, 125, 125}, 126, 111};
+		return;
+	}
+	hist = frame_histogram(src);
+	for(c = 0; c < 3; c++) {
+		levels.channel[c] = otsu_level(hist->bins[c], hist->count);
+	}
+	levels.luma = otsu_level(hist->bins[C_LUMA], hist->count);
+	levels.ordered = levels.luma - ORDERED_BIAS;
+}
+
+// Maps every channel of src through its 256 entry table
+void apply_lut(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE], GLubyte lut[3][256]) {
+	int x;
+	#pragma omp parallel for
 	for(x = 0; x < TEX_SIZE; x++) {
+		int y;
 		for(y = 0; y < TEX_SIZE; y++) {
-			result[x][y].r = (source[x][y].r > 125) ? 255 : 0;
-			result[x][y].g = (source[x][y].g > 125) ? 255 : 0;
-			result[x][y].b = (source[x][y].b > 125) ? 255 : 0;
+			dst[x][y].r = lut[C_RED][src[x][y].r];
+			dst[x][y].g = lut[C_GREEN][src[x][y].g];
+			dst[x][y].b = lut[C_BLUE][src[x][y].b];
 		}
 	}
 }
 
-void to_1bit() {
-	int x, y;
+// Table spreading the cumulative histogram over 0..255
+static void equalize_lut(unsigned int *bins, int count, GLubyte *lut) {
+	unsigned int cdf = 0, first = 0;
+	int v;
+
+	for(v = 0; v < 256 && bins[v] == 0; v++);
+	if(v < 256) first = bins[v];
+	for(v = 0; v < 256; v++) {
+		cdf += bins[v];
+		lut[v] = (count > (int)first && cdf > first) ? (cdf - first) * 255.0 / (count - first) + 0.5 : 0;
+	}
+}
+
+// Histogram equalization of luminance, its table is applied to all channels
+void equalize(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	image_hist *hist = frame_histogram(src);
+	GLubyte lut[3][256];
+
+	equalize_lut(hist->bins[C_LUMA], hist->count, lut[0]);
+	memcpy(lut[1], lut[0], 256);
+	memcpy(lut[2], lut[0], 256);
+	apply_lut(src, dst, lut);
+}
+
+// Stretches every channel so 0.5% of pixels clip on each end
+void auto_levels(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	image_hist *hist = frame_histogram(src);
+	GLubyte lut[3][256];
+	int c, v;
+
+	for(c = 0; c < 3; c++) {
+		int low = hist_percentile(hist->bins[c], hist->count, 0.005);
+		int high = hist_percentile(hist->bins[c], hist->count, 0.995);
+		if(high <= low) high = low + 1;
+		for(v = 0; v < 256; v++) {
+			lut[c][v] = get_between_0_255((v - low) * 255 / (high - low));
+		}
+	}
+	apply_lut(src, dst, lut);
+}
+
+/*
+ * Contrast limited adaptive equalization. Every CLAHE_TILE square gets its
+ * own luminance table with bins clipped at clahe_clip times the mean and the
+ * excess spread evenly, pixels blend the tables of the four nearest tiles.
+ * Channels are scaled by the ratio of the new and old luminance.
+ */
+#define CLAHE_TILE 64
+#define CLAHE_TILES (TEX_SIZE/CLAHE_TILE)
+
+float clahe_clip = 3;
+
+void clahe(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	static GLubyte tile_lut[CLAHE_TILES][CLAHE_TILES][256];
+	static int near_lo[TEX_SIZE], near_hi[TEX_SIZE];
+	static float near_weight[TEX_SIZE];
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
+	int tile, x;
+
+	#pragma omp parallel for
+	for(tile = 0; tile < CLAHE_TILES * CLAHE_TILES; tile++) {
+		unsigned int bins[256] = {0};
+		int tx = tile / CLAHE_TILES, ty = tile % CLAHE_TILES;
+		int count = CLAHE_TILE * CLAHE_TILE;
+		int limit = clahe_clip * count / 256, excess = 0, x, y, v;
+
+		for(x = tx * CLAHE_TILE; x < (tx + 1) * CLAHE_TILE; x++) {
+			for(y = ty * CLAHE_TILE; y < (ty + 1) * CLAHE_TILE; y++) bins[lum[x][y]]++;
+		}
+		if(limit < 1) limit = 1;
+		for(v = 0; v < 256; v++) {
+			if(bins[v] > limit) {
+				excess += bins[v] - limit;
+				bins[v] = limit;
+			}
+		}
+		for(v = 0; v < 256; v++) bins[v] += excess / 256 + (v < excess % 256);
+		equalize_lut(bins, count, tile_lut[tx][ty]);
+	}
+
+	// tile pair and weight of every coordinate, the same along both axes
 	for(x = 0; x < TEX_SIZE; x++) {
+		float f = (x + 0.5) / CLAHE_TILE - 0.5;
+		int t = floor(f);
+		near_weight[x] = f - t;
+		near_lo[x] = (t < 0) ? 0 : t;
+		near_hi[x] = (t + 1 < CLAHE_TILES) ? t + 1 : CLAHE_TILES - 1;
+	}
+
+	#pragma omp parallel for
+	for(x = 0; x < TEX_SIZE; x++) {
+		float wx = near_weight[x];
+		int y;
 		for(y = 0; y < TEX_SIZE; y++) {
-			int power = (source[x][y].r + source[x][y].g + source[x][y].b);
-			if(power > 380) {
-				set_pixel_color(&result[x][y], 255,255,255);
-			} else {
-				set_pixel_color(&result[x][y], 0, 0, 0);
+			float wy = near_weight[y], mapped, gain;
+			int l = lum[x][y], y0 = near_lo[y], y1 = near_hi[y];
+			mapped = (1 - wx) * ((1 - wy) * tile_lut[near_lo[x]][y0][l] + wy * tile_lut[near_lo[x]][y1][l])
+				+ wx * ((1 - wy) * tile_lut[near_hi[x]][y0][l] + wy * tile_lut[near_hi[x]][y1][l]);
+			if(l == 0) {
+				dst[x][y].r = dst[x][y].g = dst[x][y].b = mapped + 0.5;
+				continue;
 			}
-		} }
+			gain = mapped / l;
+			dst[x][y].r = get_between_0_255(src[x][y].r * gain + 0.5);
+			dst[x][y].g = get_between_0_255(src[x][y].g * gain + 0.5);
+			dst[x][y].b = get_between_0_255(src[x][y].b * gain + 0.5);
+		}
+	}
 }
 
-void to_grayscale() {
-	int x, y;
+/*
+ * Median filter in constant time per pixel (Perreault and Hebert). Every
+ * column keeps a histogram of its 2r+1 pixels in the current window rows,
+ * moving to the next row adds one pixel to it and removes one. The kernel
+ * histogram slides along the row by adding one column histogram and
+ * subtracting another, so the radius only changes the start up cost.
+ * Histograms have 16 coarse and 256 fine bins, the median is found by
+ * scanning the coarse bins and then 16 fine ones.
+ * Rows are split into bands, each band has its own column histograms.
+ */
+#define MEDIAN_BANDS 8
+
+int filter_radius = 3;
+
+typedef struct {
+	unsigned short coarse[16];
+	unsigned short fine[256];
+} histogram;
+
+static inline void hist_pixel(histogram *h, int value, int amount) {
+	h->coarse[value >> 4] += amount;
+	h->fine[value] += amount;
+}
+
+// dst += src * sign, loops are plain so they vectorize
+static inline void hist_merge(histogram *dst, histogram *src, int sign) {
+	int i;
+	for(i = 0; i < 16; i++) dst->coarse[i] += sign * src->coarse[i];
+	for(i = 0; i < 256; i++) dst->fine[i] += sign * src->fine[i];
+}
+
+// Smallest value with more than half of count pixels at or below it
+static inline int hist_median(histogram *h, int count) {
+	int half = count / 2, sum = 0, c, f;
+	for(c = 0; c < 15 && sum + h->coarse[c] <= half; c++) sum += h->coarse[c];
+	for(f = c * 16; f < c * 16 + 15 && sum + h->fine[f] <= half; f++) sum += h->fine[f];
+	return f;
+}
+
+void median_band(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE], int from, int to) {
+	int r = filter_radius;
+	histogram (*columns)[TEX_SIZE] = calloc(3, sizeof(histogram[TEX_SIZE]));
+	histogram kernel[3];
+	int x, y, c, rows;
+
+	// column histograms for the window of the row before the band
+	for(x = from - r - 1; x <= from + r - 1; x++) {
+		if(x < 0 || x >= TEX_SIZE) continue;
+		for(y = 0; y < TEX_SIZE; y++) {
+			GLubyte *channels = (GLubyte *)&src[x][y];
+			for(c = 0; c < 3; c++) hist_pixel(&columns[c][y], channels[c], 1);
+		}
+	}
+
+	for(x = from; x < to; x++) {
+		int add = x + r, remove = x - r - 1;
+		int first = (x - r < 0) ? 0 : x - r;
+		int last = (x + r >= TEX_SIZE) ? TEX_SIZE - 1 : x + r;
+		int count = 0;
+
+		if(job_stale()) break;
+		for(y = 0; y < TEX_SIZE; y++) {
+			GLubyte *channels;
+			if(add < TEX_SIZE) {
+				channels = (GLubyte *)&src[add][y];
+				for(c = 0; c < 3; c++) hist_pixel(&columns[c][y], channels[c], 1);
+			}
+			if(remove >= 0) {
+				channels = (GLubyte *)&src[remove][y];
+				for(c = 0; c < 3; c++) hist_pixel(&columns[c][y], channels[c], -1);
+			}
+		}
+		rows = last - first + 1;
 
+		memset(kernel, 0, sizeof(kernel));
+		for(y = 0; y < r && y < TEX_SIZE; y++) {
+			for(c = 0; c < 3; c++) hist_merge(&kernel[c], &columns[c][y], 1);
+			count += rows;
+		}
+		for(y = 0; y < TEX_SIZE; y++) {
+			GLubyte *out = (GLubyte *)&dst[x][y];
+			if(y + r < TEX_SIZE) {
+				for(c = 0; c < 3; c++) hist_merge(&kernel[c], &columns[c][y + r], 1);
+				count += rows;
+			}
+			if(y - r - 1 >= 0) {
+				for(c = 0; c < 3; c++) hist_merge(&kernel[c], &columns[c][y - r - 1], -1);
+				count -= rows;
+			}
+			for(c = 0; c < 3; c++) out[c] = hist_median(&kernel[c], count);
+		}
+	}
+	free(columns);
+}
+
+void median_filter(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	int band;
+	#pragma omp parallel for
+	for(band = 0; band < MEDIAN_BANDS; band++) {
+		median_band(src, dst, band * TEX_SIZE / MEDIAN_BANDS, (band + 1) * TEX_SIZE / MEDIAN_BANDS);
+	}
+}
+
+/*
+ * Bilateral filter, neighbours are weighted by distance and by how much
+ * their luminance differs. Both weights come from tables computed once per
+ * radius and sigma, the range table has one entry per luminance difference
+ * and the weights are shared by the three channels.
+ */
+float bilateral_sigma_space = 3.0;
+float bilateral_sigma_range = 20.0;
+
+void bilateral_filter(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	int r = filter_radius, size = 2 * r + 1;
+	float *space = malloc(size * size * sizeof(float));
+	float range[256];
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
+	int i, j, x;
+
+	for(i = 0; i < size; i++) {
+		for(j = 0; j < size; j++) {
+			float d2 = (i - r) * (i - r) + (j - r) * (j - r);
+			space[i * size + j] = exp(-d2 / (2 * bilateral_sigma_space * bilateral_sigma_space));
+		}
+	}
+	for(i = 0; i < 256; i++) {
+		range[i] = exp(-(float)(i * i) / (2 * bilateral_sigma_range * bilateral_sigma_range));
+	}
+
+	#pragma omp parallel for
 	for(x = 0; x < TEX_SIZE; x++) {
+		int y, nx, ny;
+		if(job_stale()) continue;
 		for(y = 0; y < TEX_SIZE; y++) {
-			int power = (0.3 * source[x][y].r + 0.59 * source[x][y].g + 0.11 * source[x][y].b);
-			result[x][y].r = result[x][y].g = result[x][y].b = power;
+			float red = 0, green = 0, blue = 0, total = 0;
+			int center = lum[x][y];
+			for(nx = x - r; nx <= x + r; nx++) {
+				float *row_w;
+				if(nx < 0 || nx >= TEX_SIZE) continue;
+				row_w = &space[(nx - x + r) * size];
+				for(ny = (y - r < 0) ? 0 : y - r; ny <= y + r && ny < TEX_SIZE; ny++) {
+					float w = row_w[ny - y + r] * range[abs(lum[nx][ny] - center)];
+					red += w * src[nx][ny].r;
+					green += w * src[nx][ny].g;
+					blue += w * src[nx][ny].b;
+					total += w;
+				}
+			}
+			set_color(dst, x, y, red / total + 0.5, green / total + 0.5, blue / total + 0.5);
 		}
 	}
+	free(space);
 }
 
-void to_grayscale_custom(pixel target[TEX_SIZE][TEX_SIZE]) {
+void to_3bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
-
+	update_levels(src);
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) {
-			int power = (0.3 * source[x][y].r + 0.59 * source[x][y].g + 0.11 * source[x][y].b);
-			target[x][y].r = target[x][y].g = target[x][y].b = power;
+			dst[x][y].r = (src[x][y].r > levels.channel[C_RED]) ? 255 : 0;
+			dst[x][y].g = (src[x][y].g > levels.channel[C_GREEN]) ? 255 : 0;
+			dst[x][y].b = (src[x][y].b > levels.channel[C_BLUE]) ? 255 : 0;
 		}
 	}
 }
 
-void to_1bit_custom(pixel target[TEX_SIZE][TEX_SIZE]) {
+void to_1bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
+	update_levels(src);
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) {
-			int power = (source[x][y].r + source[x][y].g + source[x][y].b);
-			if(power > 380) {
-				set_pixel_color(&target[x][y], 255,255,255);
+			if(lum[x][y] > levels.luma) {
+				set_pixel_color(&dst[x][y], 255,255,255);
 			} else {
-				set_pixel_color(&target[x][y], 0, 0, 0);
+				set_pixel_color(&dst[x][y], 0, 0, 0);
 			}
+		} }
+}
+
+void to_grayscale(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	int x, y;
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
+
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			int power = lum[x][y];
+			dst[x][y].r = dst[x][y].g = dst[x][y].b = power;
 		}
 	}
 }
 
-void random_dithering_1bit() {
-	int x, y;
+void to_grayscale_custom(pixel target[TEX_SIZE][TEX_SIZE]) {
+	to_grayscale(source, target);
+}
+
+void to_1bit_custom(pixel target[TEX_SIZE][TEX_SIZE]) {
+	to_1bit(source, target);
+}
+
+/*
+ * Counter based random generator used by the dithers. Every sample is a hash
+ * of the seed and its counter (row * row_length + column), so the noise has no
+ * hidden state, rows can be generated by any thread and the same seed always
+ * gives the same image.
+ */
+typedef unsigned int u32x4 __attribute__((vector_size(16)));
+
+// lowbias32 integer finalizer
+static inline unsigned int rng_mix(unsigned int h) {
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	h *= 0x846ca68b;
+	h ^= h >> 16;
+	return h;
+}
+
+unsigned int rng_hash(unsigned int seed, unsigned int counter) {
+	return rng_mix(counter + rng_mix(seed));
+}
+
+// Maps 32 random bits to 0..range-1 without a division
+static inline int rng_range(unsigned int random, int range) {
+	return ((unsigned long long)random * range) >> 32;
+}
+
+// Fills out[0..len-1] with rng_hash(seed, row*len + i), four lanes at a time
+void rng_fill_row(unsigned int seed, int row, unsigned int *out, int len) {
+	unsigned int key = rng_mix(seed);
+	unsigned int base = (unsigned int)row * len + key;
+	u32x4 lanes = {0, 1, 2, 3};
+	int i;
+
+	for(i = 0; i + 4 <= len; i += 4) {
+		u32x4 h = lanes + (base + i);
+		h ^= h >> 16;
+		h *= 0x7feb352d;
+		h ^= h >> 15;
+		h *= 0x846ca68b;
+		h ^= h >> 16;
+		memcpy(&out[i], &h, sizeof(h));
+	}
+	for(; i < len; i++) {
+		out[i] = rng_mix(base + i);
+	}
+}
+
+void random_dithering_1bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	int x;
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
+	#pragma omp parallel for
 	for(x = 0; x < TEX_SIZE; x++) {
+		unsigned int noise[TEX_SIZE];
+		int y;
+		rng_fill_row(settings.dither_seed, x, noise, TEX_SIZE);
 		for(y = 0; y < TEX_SIZE; y++) {
-			int power = (source[x][y].r + source[x][y].g + source[x][y].b);
-			if(power > 250 + (rand()%130)) {
-				set_pixel_color(&result[x][y], 255,255,255);
+			int power = 3 * lum[x][y];
+			if(power > 250 + rng_range(noise[y], 130)) {
+				set_pixel_color(&dst[x][y], 255,255,255);
 			} else {
-				set_pixel_color(&result[x][y], 0, 0, 0);
+				set_pixel_color(&dst[x][y], 0, 0, 0);
 			}
 		}
 	}
 }
 
-void to_8bit() {
+void to_8bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) {
-			result[x][y].r = truncate(source[x][y].r, 255, 8);
-			result[x][y].g = truncate(source[x][y].g, 255, 8);
-			result[x][y].b = truncate(source[x][y].b, 255, 4); 
+			dst[x][y].r = quantize(src[x][y].r, 255, 8);
+			dst[x][y].g = quantize(src[x][y].g, 255, 8);
+			dst[x][y].b = quantize(src[x][y].b, 255, 4); 
 		}
 	}
 }
 
-void random_dithering_8bit() {
-	int x, y;
+void random_dithering_8bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	int x;
+	#pragma omp parallel for
 	for(x = 0; x < TEX_SIZE; x++) {
+		unsigned int noise[3*TEX_SIZE];
+		int y;
+		rng_fill_row(settings.dither_seed, x, noise, 3*TEX_SIZE);
 		for(y = 0; y < TEX_SIZE; y++) {
-			set_pixel_color(&result[x][y],
-				truncate((source[x][y].r - 20) + rand()%40, 255, 8),
-				truncate((source[x][y].g - 20) + rand()%40, 255, 8),
-				truncate((source[x][y].b - 20) + rand()%40, 255, 4)
+			set_pixel_color(&dst[x][y],
+				quantize((src[x][y].r - 20) + rng_range(noise[3*y], 40), 255, 8),
+				quantize((src[x][y].g - 20) + rng_range(noise[3*y+1], 40), 255, 8),
+				quantize((src[x][y].b - 20) + rng_range(noise[3*y+2], 40), 255, 4)
 			);
 		}
 	}
@@ -386,100 +1886,100 @@ float threshold[2][2] = {
 	{4.0/5.0, 2.0/5.0}
 };
 
-void ordered_dithering_1bit() {
+void ordered_dithering_1bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
 
+	update_levels(src);
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) { 
-			int power = (source[x][y].r + source[x][y].g + source[x][y].b);
+			int power = lum[x][y];
 			power += threshold[x%2][y%2];
 
-			if(power > 335) {
-				set_pixel_color(&result[x][y], 255, 255, 255);
+			if(power > levels.ordered) {
+				set_pixel_color(&dst[x][y], 255, 255, 255);
 			} else {
-				set_pixel_color(&result[x][y], 0, 0, 0);
+				set_pixel_color(&dst[x][y], 0, 0, 0);
 			}
 		}
 	}
 }
 
-void ordered_dithering_8bit() {
+void ordered_dithering_8bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
 	float threshld;
 	
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) {
 			threshld = threshold[x%2][y%2];
-			set_pixel_color(&result[x][y],
-				truncate((float)source[x][y].r + (threshld*20), 255, 8),
-				truncate((float)source[x][y].g + (threshld*20), 255, 8),
-				truncate((float)source[x][y].b + (threshld*20), 255, 4)
+			set_pixel_color(&dst[x][y],
+				quantize((float)src[x][y].r + (threshld*20), 255, 8),
+				quantize((float)src[x][y].g + (threshld*20), 255, 8),
+				quantize((float)src[x][y].b + (threshld*20), 255, 4)
 			);
 		}
 	}
 }
 
-void error_diff_dither_1bit() {
+void error_diff_dither_1bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
 
 	static float workspace[TEX_SIZE][TEX_SIZE];
 	float error;
+	GLubyte (*lum)[TEX_SIZE] = luma_plane(src);
 
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) {
-			workspace[x][y] = (
-				0.3 * source[x][y].r +
-				0.59 * source[x][y].g +
-				0.11 * source[x][y].b
-			) / 255.0;
+			workspace[x][y] = lum[x][y] / 255.0;
 		}
 	}
 
 	for(x = 0; x < TEX_SIZE; x++) {
+		if(job_stale()) return;
 		for(y = 0; y < TEX_SIZE; y++) {
 			if(workspace[x][y] > 0.5) {
-				set_pixel_color(&result[x][y], 255,255,255);
+				set_pixel_color(&dst[x][y], 255,255,255);
 				error = workspace[x][y] - 1;
 			} else {
-				set_pixel_color(&result[x][y], 0, 0, 0);
+				set_pixel_color(&dst[x][y], 0, 0, 0);
 				error = workspace[x][y];
 			}
 
-			if(x<TEX_SIZE) {
+			if(x+1 < TEX_SIZE) {
 				workspace[x+1][y] += 7.0/16.0*error;
 			}
 
-			if(x>0 && y<TEX_SIZE) {
+			if(x>0 && y+1 < TEX_SIZE) {
 				workspace[x-1][y+1] += 3.0/16.0*error;
 			}
 
-			if(y < TEX_SIZE) {
+			if(y+1 < TEX_SIZE) {
 				workspace[x][y+1] += 5.0/16.0*error;
 			}
 
-			if(x < TEX_SIZE && y < TEX_SIZE) {
+			if(x+1 < TEX_SIZE && y+1 < TEX_SIZE) {
 				workspace[x+1][y+1] += 1.0/16.0*error;
 			}
 		}
 	}
 }
 
-void error_diff_dither_8bit() {
+void error_diff_dither_8bit(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
 	int x, y, c;
 	float error;
 
 	static pixel workspace[TEX_SIZE][TEX_SIZE];
-	memcpy(&workspace, source, sizeof(workspace)); 
+	memcpy(&workspace, src, sizeof(workspace)); 
 
 	int channel_sizes[3] = {8,8,4};
 
 	for(x = 0; x < TEX_SIZE; x++) {
 		for(y = 0; y < TEX_SIZE; y++) {
 			char unsigned *channels = (char unsigned *)&workspace[x][y];
-			char unsigned *res_channels = (char unsigned *)&result[x][y];
+			char unsigned *res_channels = (char unsigned *)&dst[x][y];
 			char unsigned *error_channels;
 			for(c = 0; c < 3; c++) {
-				res_channels[c] = truncate(channels[c], 255, channel_sizes[c]);
+				res_channels[c] = quantize(channels[c], 255, channel_sizes[c]);
 				error = channels[c] - res_channels[c];
 
 				if(x<TEX_SIZE) {
@@ -503,69 +2003,1096 @@ void error_diff_dither_8bit() {
 	}
 }
 
-void (*reduce)() = to_1bit;
+/*
+ * Morphology with a morph_size x morph_size square, mainly to clean up the
+ * outputs of the 1-bit reducers. Both directions use the van Herk/Gil-Werman
+ * algorithm: the line is cut into blocks of the window length, prefix and
+ * suffix minima (maxima) are taken inside every block and any window is the
+ * min of one suffix and one prefix, about three comparisons per pixel for
+ * any length. Passes run along the first index on whole rows at once.
+ * Black and white images are packed 64 pixels per word where min and max
+ * become AND and OR and the horizontal pass is done by shifting words.
+ */
+#define MORPH_NONE 0
+#define MORPH_ERODE 1
+#define MORPH_DILATE 2
+#define MORPH_OPEN 3
+#define MORPH_CLOSE 4
+#define BIT_WORDS (TEX_SIZE/64)
+
+int morph_size = 5;
+
+static inline GLubyte morph_pick(GLubyte a, GLubyte b, int dilate) {
+	return dilate ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+// vHGW along the first index of a byte plane, outside pixels never win
+void vhgw_plane(GLubyte plane[TEX_SIZE][TEX_SIZE], int size, int dilate) {
+	int r = size / 2;
+	int n = (TEX_SIZE + 2*r + size - 1) / size * size;
+	GLubyte (*g)[TEX_SIZE] = malloc(n * TEX_SIZE);
+	GLubyte (*h)[TEX_SIZE] = malloc(n * TEX_SIZE);
+	GLubyte pad[TEX_SIZE];
+	int i, y;
+
+	memset(pad, dilate ? 0 : 255, sizeof(pad));
+	for(i = 0; i < n; i++) {
+		GLubyte *in = (i >= r && i - r < TEX_SIZE) ? plane[i - r] : pad;
+		if(i % size == 0) {
+			memcpy(g[i], in, TEX_SIZE);
+		} else {
+			for(y = 0; y < TEX_SIZE; y++) g[i][y] = morph_pick(g[i-1][y], in[y], dilate);
+		}
+	}
+	for(i = n - 1; i >= 0; i--) {
+		GLubyte *in = (i >= r && i - r < TEX_SIZE) ? plane[i - r] : pad;
+		if((i + 1) % size == 0) {
+			memcpy(h[i], in, TEX_SIZE);
+		} else {
+			for(y = 0; y < TEX_SIZE; y++) h[i][y] = morph_pick(h[i+1][y], in[y], dilate);
+		}
+	}
+	for(i = 0; i < TEX_SIZE; i++) {
+		for(y = 0; y < TEX_SIZE; y++) plane[i][y] = morph_pick(h[i][y], g[i + size - 1][y], dilate);
+	}
+	free(g);
+	free(h);
+}
+
+void transpose_bytes(GLubyte in[TEX_SIZE][TEX_SIZE], GLubyte out[TEX_SIZE][TEX_SIZE]) {
+	int bx, by, x, y;
+	for(bx = 0; bx < TEX_SIZE; bx += 32) {
+		for(by = 0; by < TEX_SIZE; by += 32) {
+			for(x = bx; x < bx + 32; x++) {
+				for(y = by; y < by + 32; y++) {
+					out[y][x] = in[x][y];
+				}
+			}
+		}
+	}
+}
+
+// vHGW along the first index of a packed image, min is AND and max is OR
+void vhgw_bits(uint64_t bits[TEX_SIZE][BIT_WORDS], int size, int dilate) {
+	int r = size / 2;
+	int n = (TEX_SIZE + 2*r + size - 1) / size * size;
+	uint64_t (*g)[BIT_WORDS] = malloc(n * sizeof(uint64_t[BIT_WORDS]));
+	uint64_t (*h)[BIT_WORDS] = malloc(n * sizeof(uint64_t[BIT_WORDS]));
+	uint64_t pad[BIT_WORDS];
+	int i, w;
+
+	memset(pad, dilate ? 0 : 0xff, sizeof(pad));
+	for(i = 0; i < n; i++) {
+		uint64_t *in = (i >= r && i - r < TEX_SIZE) ? bits[i - r] : pad;
+		for(w = 0; w < BIT_WORDS; w++) {
+			if(i % size == 0) g[i][w] = in[w];
+			else g[i][w] = dilate ? (g[i-1][w] | in[w]) : (g[i-1][w] & in[w]);
+		}
+	}
+	for(i = n - 1; i >= 0; i--) {
+		uint64_t *in = (i >= r && i - r < TEX_SIZE) ? bits[i - r] : pad;
+		for(w = 0; w < BIT_WORDS; w++) {
+			if((i + 1) % size == 0) h[i][w] = in[w];
+			else h[i][w] = dilate ? (h[i+1][w] | in[w]) : (h[i+1][w] & in[w]);
+		}
+	}
+	for(i = 0; i < TEX_SIZE; i++) {
+		for(w = 0; w < BIT_WORDS; w++) {
+			bits[i][w] = dilate ? (h[i][w] | g[i + size - 1][w]) : (h[i][w] & g[i + size - 1][w]);
+		}
+	}
+	free(g);
+	free(h);
+}
+
+// out bit y = in bit y+shift for words words, bits outside read as fill
+static inline void bits_shift(uint64_t *in, uint64_t *out, int words, int shift, uint64_t fill) {
+	int q = shift >> 6, m = shift & 63, w;
+	for(w = 0; w < words; w++) {
+		int lo = w + q, hi = w + q + 1;
+		uint64_t a = (lo >= 0 && lo < words) ? in[lo] : fill;
+		uint64_t b = (hi >= 0 && hi < words) ? in[hi] : fill;
+		out[w] = m ? (a >> m) | (b << (64 - m)) : a;
+	}
+}
+
+/*
+ * Window along the row by doubling: span 2s is span s combined with itself
+ * shifted by s. The row is padded by whole words so spans starting left of
+ * it see the padding and not the fill.
+ */
+void bits_row_window(uint64_t *row, int size, int dilate) {
+	int pad = (size / 2 + 63) / 64;
+	int words = BIT_WORDS + 2*pad;
+	uint64_t span[words], shifted[words], other[words];
+	uint64_t fill = dilate ? 0 : ~0ULL;
+	int len = 1, w;
+
+	for(w = 0; w < words; w++) span[w] = (w >= pad && w - pad < BIT_WORDS) ? row[w - pad] : fill;
+	while(len * 2 <= size) {
+		bits_shift(span, shifted, words, len, fill);
+		for(w = 0; w < words; w++) span[w] = dilate ? span[w] | shifted[w] : span[w] & shifted[w];
+		len *= 2;
+	}
+	// two spans of len cover exactly [y - r, y + r]
+	bits_shift(span, shifted, words, -(size / 2), fill);
+	bits_shift(span, other, words, size - len - size / 2, fill);
+	for(w = 0; w < BIT_WORDS; w++) {
+		row[w] = dilate ? shifted[w + pad] | other[w + pad] : shifted[w + pad] & other[w + pad];
+	}
+}
+
+// True if every pixel is pure black or white
+int is_binary(pixel src[TEX_SIZE][TEX_SIZE]) {
+	int x, y;
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			pixel *p = &src[x][y];
+			if(p->r != p->g || p->g != p->b || (p->r != 0 && p->r != 255)) return 0;
+		}
+	}
+	return 1;
+}
+
+void morphology_bits(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE], int dilate) {
+	static uint64_t bits[TEX_SIZE][BIT_WORDS];
+	int x, y;
+
+	memset(bits, 0, sizeof(bits));
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			if(src[x][y].r) bits[x][y >> 6] |= 1ULL << (y & 63);
+		}
+	}
+	vhgw_bits(bits, morph_size, dilate);
+	for(x = 0; x < TEX_SIZE; x++) {
+		bits_row_window(bits[x], morph_size, dilate);
+		for(y = 0; y < TEX_SIZE; y++) {
+			GLubyte v = (bits[x][y >> 6] >> (y & 63) & 1) ? 255 : 0;
+			dst[x][y].r = dst[x][y].g = dst[x][y].b = v;
+		}
+	}
+}
+
+void morphology(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE], int dilate) {
+	static GLubyte planes[3][TEX_SIZE][TEX_SIZE];
+	static GLubyte tmp[TEX_SIZE][TEX_SIZE];
+	int x, y, c;
+
+	if(is_binary(src)) {
+		morphology_bits(src, dst, dilate);
+		return;
+	}
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			planes[C_RED][x][y] = src[x][y].r;
+			planes[C_GREEN][x][y] = src[x][y].g;
+			planes[C_BLUE][x][y] = src[x][y].b;
+		}
+	}
+	#pragma omp parallel for private(tmp)
+	for(c = 0; c < 3; c++) {
+		vhgw_plane(planes[c], morph_size, dilate);
+		transpose_bytes(planes[c], tmp);
+		vhgw_plane(tmp, morph_size, dilate);
+		transpose_bytes(tmp, planes[c]);
+	}
+	for(x = 0; x < TEX_SIZE; x++) {
+		for(y = 0; y < TEX_SIZE; y++) {
+			dst[x][y].r = planes[C_RED][x][y];
+			dst[x][y].g = planes[C_GREEN][x][y];
+			dst[x][y].b = planes[C_BLUE][x][y];
+		}
+	}
+}
+
+void erode(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	morphology(src, dst, 0);
+}
+
+void dilate(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	morphology(src, dst, 1);
+}
+
+// Opening removes specks, erosion then dilation (dst holds the middle step)
+void morph_open(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	morphology(src, dst, 0);
+	morphology(dst, dst, 1);
+}
+
+// Closing fills small holes, dilation then erosion
+void morph_close(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	morphology(src, dst, 1);
+	morphology(dst, dst, 0);
+}
+
+// Blends both layers over src, the layers mode
+void blend_layers(pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]) {
+	if(src != dst) {
+		memcpy(*dst, *src, TEX_SIZE*TEX_SIZE*sizeof(pixel));
+	}
+	blend_layer_at(dst, layer1, settings.alpha_x, 0);
+	blend_layer_at(dst, layer2, 50, 50);
+}
+
+/*
+ * Row variants of the point-wise stages, used when several of them are fused
+ * into one pass. They work in place on row x and must give the same pixels
+ * as the frame kernels. Reducers read levels that the prepare hook of their
+ * stage computes from its input, so such a stage always starts a new pass.
+ */
+void to_3bit_row(int x, pixel *row) {
+	int y;
+	for(y = 0; y < TEX_SIZE; y++) {
+		row[y].r = (row[y].r > levels.channel[C_RED]) ? 255 : 0;
+		row[y].g = (row[y].g > levels.channel[C_GREEN]) ? 255 : 0;
+		row[y].b = (row[y].b > levels.channel[C_BLUE]) ? 255 : 0;
+	}
+}
+
+void to_1bit_row(int x, pixel *row) {
+	GLubyte lum[TEX_SIZE];
+	int y;
+	luma_row(row, lum, TEX_SIZE);
+	for(y = 0; y < TEX_SIZE; y++) {
+		row[y].r = row[y].g = row[y].b = (lum[y] > levels.luma) ? 255 : 0;
+	}
+}
+
+void to_grayscale_row(int x, pixel *row) {
+	GLubyte lum[TEX_SIZE];
+	int y;
+	luma_row(row, lum, TEX_SIZE);
+	for(y = 0; y < TEX_SIZE; y++) {
+		row[y].r = row[y].g = row[y].b = lum[y];
+	}
+}
+
+void to_8bit_row(int x, pixel *row) {
+	int y;
+	for(y = 0; y < TEX_SIZE; y++) {
+		row[y].r = quantize(row[y].r, 255, 8);
+		row[y].g = quantize(row[y].g, 255, 8);
+		row[y].b = quantize(row[y].b, 255, 4);
+	}
+}
+
+void random_dithering_1bit_row(int x, pixel *row) {
+	GLubyte lum[TEX_SIZE];
+	unsigned int noise[TEX_SIZE];
+	int y;
+	luma_row(row, lum, TEX_SIZE);
+	rng_fill_row(settings.dither_seed, x, noise, TEX_SIZE);
+	for(y = 0; y < TEX_SIZE; y++) {
+		int power = 3 * lum[y];
+		row[y].r = row[y].g = row[y].b = (power > 250 + rng_range(noise[y], 130)) ? 255 : 0;
+	}
+}
+
+void random_dithering_8bit_row(int x, pixel *row) {
+	unsigned int noise[3*TEX_SIZE];
+	int y;
+	rng_fill_row(settings.dither_seed, x, noise, 3*TEX_SIZE);
+	for(y = 0; y < TEX_SIZE; y++) {
+		set_pixel_color(&row[y],
+			quantize((row[y].r - 20) + rng_range(noise[3*y], 40), 255, 8),
+			quantize((row[y].g - 20) + rng_range(noise[3*y+1], 40), 255, 8),
+			quantize((row[y].b - 20) + rng_range(noise[3*y+2], 40), 255, 4)
+		);
+	}
+}
+
+void ordered_dithering_1bit_row(int x, pixel *row) {
+	GLubyte lum[TEX_SIZE];
+	int y;
+	luma_row(row, lum, TEX_SIZE);
+	for(y = 0; y < TEX_SIZE; y++) {
+		int power = lum[y];
+		power += threshold[x%2][y%2];
+		row[y].r = row[y].g = row[y].b = (power > levels.ordered) ? 255 : 0;
+	}
+}
+
+void ordered_dithering_8bit_row(int x, pixel *row) {
+	int y;
+	for(y = 0; y < TEX_SIZE; y++) {
+		float threshld = threshold[x%2][y%2];
+		set_pixel_color(&row[y],
+			quantize((float)row[y].r + (threshld*20), 255, 8),
+			quantize((float)row[y].g + (threshld*20), 255, 8),
+			quantize((float)row[y].b + (threshld*20), 255, 4)
+		);
+	}
+}
+
+// Blends row lx of layer placed at (start_x, start_y) over row x
+void blend_row_at(int x, pixel *row, rgba_pix layer[TEX_SIZE][TEX_SIZE], int start_x, int start_y) {
+	int y, lx = x - start_x;
+	if(lx < 0) return;
+	for(y = start_y; y < TEX_SIZE; y++) {
+		rgba_pix *l = &layer[lx][y - start_y];
+		float alp = (float)(l->a) / 255.0;
+		set_pixel_color(&row[y],
+			l->r * alp + row[y].r*(1-alp),
+			l->g * alp + row[y].g*(1-alp),
+			l->b * alp + row[y].b*(1-alp)
+		);
+	}
+}
+
+void blend_layers_row(int x, pixel *row) {
+	blend_row_at(x, row, layer1, settings.alpha_x, 0);
+	blend_row_at(x, row, layer2, 50, 50);
+}
+
+/*
+ * Effect pipeline, any chain of effects, blends and reducers. A stage has a
+ * frame kernel and, when it is point-wise, also a row function; runs of
+ * adjacent point stages are fused into a single pass over the image that
+ * keeps each row in cache while all of them are applied.
+ * Intermediate frames are taken from a pool and given back as soon as the
+ * next stage consumed them, so a chain of any length needs at most two.
+ */
+#define PIPE_MAX 16
+#define POOL_MAX 4
+
+#define FRAME_STAGE(fn) ((stage){#fn, fn, NULL, NULL})
+#define POINT_STAGE(fn) ((stage){#fn, fn, fn##_row, NULL})
+#define LEVELS_STAGE(fn) ((stage){#fn, fn, fn##_row, update_levels})
+
+typedef struct {
+	int len;
+	stage stages[PIPE_MAX];
+} pipeline;
+
+typedef struct {
+	int count;
+	int used[POOL_MAX];
+	pixel (*frames[POOL_MAX])[TEX_SIZE];
+} frame_pool;
+
+pixel (*pool_acquire(frame_pool *pool))[TEX_SIZE] {
+	int i;
+	for(i = 0; i < pool->count; i++) {
+		if(!pool->used[i]) break;
+	}
+	if(i == pool->count) {
+		if(pool->count == POOL_MAX) {
+			printf("Frame pool exhausted\n");
+			exit(1);
+		}
+		pool->frames[pool->count++] = malloc(TEX_SIZE*TEX_SIZE*sizeof(pixel));
+	}
+	pool->used[i] = 1;
+	return pool->frames[i];
+}
+
+void pool_release(frame_pool *pool, pixel (*frame)[TEX_SIZE]) {
+	int i;
+	for(i = 0; i < pool->count; i++) {
+		if(pool->frames[i] == frame) pool->used[i] = 0;
+	}
+}
+
+void pipe_clear(pipeline *pipe) {
+	pipe->len = 0;
+}
+
+void pipe_add(pipeline *pipe, stage st) {
+	if(pipe->len < PIPE_MAX) {
+		pipe->stages[pipe->len++] = st;
+	}
+}
+
+// Runs point stages first..last-1 in one pass, may run in place
+void pipe_run_points(
+	pipeline *pipe, int first, int last,
+	pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]
+) {
+	int x;
+	if(pipe->stages[first].prepare != NULL) pipe->stages[first].prepare(src);
+	#pragma omp parallel for
+	for(x = 0; x < TEX_SIZE; x++) {
+		pixel row[TEX_SIZE];
+		int i;
+		memcpy(row, src[x], sizeof(row));
+		for(i = first; i < last; i++) {
+			pipe->stages[i].point(x, row);
+		}
+		memcpy(dst[x], row, sizeof(row));
+	}
+}
+
+void pipe_run(
+	pipeline *pipe, frame_pool *pool,
+	pixel src[TEX_SIZE][TEX_SIZE], pixel dst[TEX_SIZE][TEX_SIZE]
+) {
+	pixel (*in)[TEX_SIZE] = src;
+	pixel (*out)[TEX_SIZE];
+	int i = 0, last;
+
+	if(pipe->len == 0) {
+		memcpy(*dst, *src, TEX_SIZE*TEX_SIZE*sizeof(pixel));
+		return;
+	}
+
+	while(i < pipe->len) {
+		last = i + 1;
+		if(pipe->stages[i].point != NULL) {
+			while(last < pipe->len && pipe->stages[last].point != NULL
+				&& pipe->stages[last].prepare == NULL) last++;
+		}
+
+		out = (last == pipe->len) ? dst : pool_acquire(pool);
+		if(last - i > 1) {
+			pipe_run_points(pipe, i, last, in, out);
+		} else {
+			pipe->stages[i].frame(in, out);
+		}
+		if(in != src) pool_release(pool, in);
+
+		in = out;
+		i = last;
+	}
+}
+
+/*
+ * IMAGE_SIZE=WIDTHxHEIGHT gives the size of a non square image.rgb, the
+ * other files are square of any side. RESAMPLE selects the filter used
+ * when they are not TEX_SIZE (nearest, bilinear, bicubic, lanczos).
+ */
+void image_options(int *width, int *height) {
+	char *size = getenv("IMAGE_SIZE");
+	char *filter = getenv("RESAMPLE");
+	int i;
+
+	*width = *height = 0;
+	if(size != NULL && sscanf(size, "%dx%d", width, height) != 2) {
+		*width = *height = 0;
+	}
+	for(i = 0; filter != NULL && i < 4; i++) {
+		if(strcmp(filter, resample_names[i]) == 0) resample_filter = i;
+	}
+}
+
+void load_images() {
+	int width, height;
+
+	image_options(&width, &height);
+	load_rgb(source, "image.rgb", width, height);
+	source_version++;
+	load_rgba(layer1,"image.rgba", 0, 0);
+	load_rgba(layer2, "top.rgba", 0, 0);
+}
+
+// Builds the pipeline of the current mode
+void mode_pipeline(pipeline *pipe) {
+	pipe_clear(pipe);
+	switch(settings.mode) {
+		case DISPLAY_LAYERS:
+			pipe_add(pipe, POINT_STAGE(blend_layers));
+			break;
+		case DISPLAY_EFFECT:
+			pipe_add(pipe, settings.effect);
+			break;
+		case DISPLAY_FRACTAL:
+			pipe_add(pipe, FRAME_STAGE(print_fractal));
+			break;
+		case DISPLAY_TO_LESSBIT:
+			pipe_add(pipe, settings.reduce);
+			break;
+		case DISPLAY_CHAIN:
+			pipe_add(pipe, settings.effect);
+			pipe_add(pipe, settings.reduce);
+			break;
+	}
+	if(settings.mode == DISPLAY_TO_LESSBIT || settings.mode == DISPLAY_CHAIN) {
+		switch(settings.morph_op) {
+			case MORPH_ERODE: pipe_add(pipe, FRAME_STAGE(erode)); break;
+			case MORPH_DILATE: pipe_add(pipe, FRAME_STAGE(dilate)); break;
+			case MORPH_OPEN: pipe_add(pipe, FRAME_STAGE(morph_open)); break;
+			case MORPH_CLOSE: pipe_add(pipe, FRAME_STAGE(morph_close)); break;
+		}
+	}
+}
+
+// Computes the frame of the current mode into result
+void compute_frame() {
+	static pipeline pipe;
+	static frame_pool pool;
+
+	mode_pipeline(&pipe);
+	pipe_run(&pipe, &pool, source, result);
+}
+
+#ifdef HEADLESS
+
+/*
+ * Batch mode without a window (make gradient_headless). Every argument is a
+ * raw RGB image, a directory (its *.rgb files) or - to read a list of paths
+ * from stdin. Images go through CHAIN, a comma separated list of stages
+ * (default sharpen,to_1bit), and are written as TEX_SIZE x TEX_SIZE raw RGB
+ * under their own name into the OUTPUT directory (default out, OUTPUT=none
+ * only measures), inputs sharing a name are refused. IMAGE_SIZE and RESAMPLE
+ * apply to every input.
+ *
+ * Effects keep scratch buffers and caches in globals, so the WORKERS (one
+ * per core by default) are processes and each has its own copy of them.
+ * Inside a worker a loader and a writer thread overlap with the effects,
+ * frames go round through bounded queues free -> loaded -> done -> free so
+ * no stage gets more than BATCH_DEPTH images ahead of the next one. Workers
+ * claim images one at a time from a shared counter, at the end images/s and
+ * the time per image of every stage are printed to stderr.
+ *   WORKERS=4 CHAIN=blur,to_3bit OUTPUT=result ./gradient_headless images/
+ */
+#define BATCH_DEPTH 4 //Images one stage may get ahead of the next one
+#define BATCH_FRAMES (2 * BATCH_DEPTH + 2) //Frames owned by one worker
+#define BATCH_MAX_WORKERS 256
+
+typedef struct {
+	pixel (*frame)[TEX_SIZE];
+	int index; //Input number, -1 ends the stream
+} batch_item;
+
+typedef struct {
+	batch_item items[BATCH_FRAMES];
+	int head, len, size;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} batch_queue;
+
+typedef struct {
+	int images; //Written by the writer thread
+	int unreadable; //Counted by the loader thread
+	int unwritable;
+	long long load_ns, compute_ns, write_ns;
+} batch_stats;
+
+// Mapped shared before the workers are forked
+typedef struct {
+	atomic_int next; //First input nobody claimed yet
+	batch_stats workers[BATCH_MAX_WORKERS];
+} batch_shared;
+
+// Stages CHAIN can name
+stage batch_stages[] = {
+	FRAME_STAGE(blur), FRAME_STAGE(blur5x), FRAME_STAGE(sharpen), FRAME_STAGE(emboss),
+	FRAME_STAGE(edge_detection1), FRAME_STAGE(edge_detection3), FRAME_STAGE(motion_blur),
+	FRAME_STAGE(gaussian_blur), FRAME_STAGE(median_filter), FRAME_STAGE(bilateral_filter),
+	FRAME_STAGE(equalize), FRAME_STAGE(clahe), FRAME_STAGE(auto_levels),
+	POINT_STAGE(blend_layers), POINT_STAGE(to_grayscale),
+	LEVELS_STAGE(to_3bit), LEVELS_STAGE(to_1bit), POINT_STAGE(to_8bit),
+	POINT_STAGE(random_dithering_1bit), POINT_STAGE(random_dithering_8bit),
+	LEVELS_STAGE(ordered_dithering_1bit), POINT_STAGE(ordered_dithering_8bit),
+	FRAME_STAGE(error_diff_dither_1bit), FRAME_STAGE(error_diff_dither_8bit),
+	FRAME_STAGE(erode), FRAME_STAGE(dilate), FRAME_STAGE(morph_open), FRAME_STAGE(morph_close)
+};
+
+char **batch_inputs;
+int batch_count = 0;
+int batch_capacity = 0;
+int batch_width, batch_height;
+int batch_threads = 1; //OpenMP threads of one worker
+char *batch_output = "out"; //NULL only measures
+pipeline batch_pipe;
+batch_shared *shared;
+batch_stats *stats; //Slot of this worker in shared
+batch_queue free_frames, loaded, done;
+
+void queue_init(batch_queue *queue, int size) {
+	queue->head = queue->len = 0;
+	queue->size = size;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->changed, NULL);
+}
+
+// Waits while the queue is full
+void queue_push(batch_queue *queue, batch_item item) {
+	pthread_mutex_lock(&queue->lock);
+	while(queue->len == queue->size) pthread_cond_wait(&queue->changed, &queue->lock);
+	queue->items[(queue->head + queue->len++) % queue->size] = item;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+// Waits while the queue is empty
+batch_item queue_pop(batch_queue *queue) {
+	batch_item item;
+
+	pthread_mutex_lock(&queue->lock);
+	while(queue->len == 0) pthread_cond_wait(&queue->changed, &queue->lock);
+	item = queue->items[queue->head];
+	queue->head = (queue->head + 1) % queue->size;
+	queue->len--;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+void batch_add(char *path) {
+	if(batch_count == batch_capacity) {
+		batch_capacity = batch_capacity ? 2 * batch_capacity : 64;
+		batch_inputs = realloc(batch_inputs, batch_capacity * sizeof(char*));
+	}
+	batch_inputs[batch_count++] = strdup(path);
+}
+
+static int path_cmp(const void *a, const void *b) {
+	return strcmp(*(char**)a, *(char**)b);
+}
+
+// File name of the result, the input without its directory
+static char *batch_name(char *path) {
+	char *name = strrchr(path, '/');
+	return (name != NULL) ? name + 1 : path;
+}
+
+// Results are named after their inputs, fails when two inputs share a name
+int batch_unique_names() {
+	char **names = malloc(batch_count * sizeof(char*));
+	int i, unique = 1;
+
+	for(i = 0; i < batch_count; i++) names[i] = batch_name(batch_inputs[i]);
+	qsort(names, batch_count, sizeof(char*), path_cmp);
+	for(i = 1; i < batch_count && unique; i++) {
+		if(strcmp(names[i-1], names[i]) == 0) {
+			fprintf(stderr, "Two inputs are named %s, their results would overwrite each other\n", names[i]);
+			unique = 0;
+		}
+	}
+	free(names);
+	return unique ? 0 : -1;
+}
+
+// Adds a file, the *.rgb files of a directory or the paths on stdin for -
+int batch_collect(char *arg) {
+	char path[4096];
+	struct stat st;
+
+	if(strcmp(arg, "-") == 0) {
+		while(fgets(path, sizeof(path), stdin) != NULL) {
+			path[strcspn(path, "\r\n")] = '\0';
+			if(*path != '\0') batch_add(path);
+		}
+	} else if(stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(arg);
+		struct dirent *entry;
+		int first = batch_count;
+
+		if(dir == NULL) {
+			fprintf(stderr, "Error openning %s\n", arg);
+			return -1;
+		}
+		while((entry = readdir(dir)) != NULL) {
+			size_t len = strlen(entry->d_name);
+			if(len <= 4 || strcmp(entry->d_name + len - 4, ".rgb") != 0) continue;
+			snprintf(path, sizeof(path), "%s/%s", arg, entry->d_name);
+			batch_add(path);
+		}
+		closedir(dir);
+		qsort(&batch_inputs[first], batch_count - first, sizeof(char*), path_cmp);
+	} else {
+		batch_add(arg);
+	}
+	return 0;
+}
+
+// Fills pipe from the stage names in chain
+int chain_parse(pipeline *pipe, char *chain) {
+	int count = sizeof(batch_stages) / sizeof(stage), i;
+	char *copy = strdup(chain), *save, *name;
+
+	pipe_clear(pipe);
+	for(name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+		for(i = 0; i < count && strcmp(batch_stages[i].name, name) != 0; i++);
+		if(i == count) {
+			fprintf(stderr, "Unknown stage %s in CHAIN\n", name);
+			free(copy);
+			return -1;
+		}
+		pipe_add(pipe, batch_stages[i]);
+	}
+	free(copy);
+	return 0;
+}
+
+int write_raw(char *path, pixel frame[TEX_SIZE][TEX_SIZE]) {
+	FILE *out = fopen(path, "wb");
+	int written;
+
+	if(out == NULL) {
+		fprintf(stderr, "Error openning %s\n", path);
+		return -1;
+	}
+	written = fwrite(frame, sizeof(pixel), TEX_SIZE*TEX_SIZE, out);
+	if(fclose(out) != 0 || written != TEX_SIZE*TEX_SIZE) {
+		fprintf(stderr, "Error writing %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+void *batch_loader(void *arg) {
+	omp_set_num_threads(batch_threads);
+	for(;;) {
+		batch_item item = queue_pop(&free_frames);
+		long long start = trace_now_ns();
+
+		item.index = atomic_fetch_add(&shared->next, 1);
+		if(item.index >= batch_count) {
+			queue_push(&free_frames, item);
+			break;
+		}
+		if(read_raw(&item.frame[0][0].r, batch_inputs[item.index], batch_width, batch_height, sizeof(pixel)) != 0) {
+			stats->unreadable++;
+			queue_push(&free_frames, item);
+			continue;
+		}
+		stats->load_ns += trace_now_ns() - start;
+		queue_push(&loaded, item);
+	}
+	queue_push(&loaded, (batch_item){NULL, -1});
+	return NULL;
+}
+
+void *batch_writer(void *arg) {
+	char path[4096];
+
+	for(;;) {
+		batch_item item = queue_pop(&done);
+		long long start = trace_now_ns();
+
+		if(item.index < 0) break;
+		if(batch_output != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", batch_output, batch_name(batch_inputs[item.index]));
+			if(write_raw(path, item.frame) != 0) {
+				stats->unwritable++;
+				queue_push(&free_frames, item);
+				continue;
+			}
+		}
+		stats->images++;
+		stats->write_ns += trace_now_ns() - start;
+		queue_push(&free_frames, item);
+	}
+	return NULL;
+}
+
+// Body of one forked worker, the effects run on its main thread
+int batch_worker() {
+	pixel (*frames)[TEX_SIZE][TEX_SIZE] = malloc(BATCH_FRAMES * sizeof(*frames));
+	frame_pool pool = {0};
+	pthread_t loader, writer;
+	int i;
+
+	omp_set_num_threads(batch_threads);
+	for(i = 0; i < batch_pipe.len; i++) {
+		if(batch_pipe.stages[i].frame == blend_layers) {
+			load_rgba(layer1, "image.rgba", 0, 0);
+			load_rgba(layer2, "top.rgba", 0, 0);
+		}
+	}
+	queue_init(&free_frames, BATCH_FRAMES);
+	queue_init(&loaded, BATCH_DEPTH);
+	queue_init(&done, BATCH_DEPTH);
+	for(i = 0; i < BATCH_FRAMES; i++) queue_push(&free_frames, (batch_item){frames[i], 0});
+	pthread_create(&loader, NULL, batch_loader, NULL);
+	pthread_create(&writer, NULL, batch_writer, NULL);
+
+	for(;;) {
+		batch_item item = queue_pop(&loaded), out;
+		long long start;
+
+		if(item.index < 0) break;
+		out = queue_pop(&free_frames);
+		start = trace_now_ns();
+		// Caches of luminance, planes and histograms follow source
+		source = item.frame;
+		source_version++;
+		pipe_run(&batch_pipe, &pool, item.frame, out.frame);
+		stats->compute_ns += trace_now_ns() - start;
+		out.index = item.index;
+		queue_push(&free_frames, item);
+		queue_push(&done, out);
+	}
+	queue_push(&done, (batch_item){NULL, -1});
+	pthread_join(loader, NULL);
+	pthread_join(writer, NULL);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char ** argv) {
+	char *chain = getenv("CHAIN"), *output = getenv("OUTPUT"), *env = getenv("WORKERS");
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int workers = (env != NULL && atoi(env) > 0) ? atoi(env) : cores;
+	batch_stats sum = {0};
+	long long start, total;
+	int i;
+
+	if(chain_parse(&batch_pipe, (chain != NULL) ? chain : "sharpen,to_1bit") != 0) return EXIT_FAILURE;
+	for(i = 1; i < argc; i++) {
+		if(batch_collect(argv[i]) != 0) return EXIT_FAILURE;
+	}
+	if(batch_count == 0) {
+		fprintf(stderr, "Usage: %s image.rgb | directory | - ...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(output != NULL) batch_output = (strcmp(output, "none") == 0) ? NULL : output;
+	if(batch_output != NULL && batch_unique_names() != 0) return EXIT_FAILURE;
+	if(batch_output != NULL && mkdir(batch_output, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating %s\n", batch_output);
+		return EXIT_FAILURE;
+	}
+	image_options(&batch_width, &batch_height);
+	if(workers > batch_count) workers = batch_count;
+	if(workers > BATCH_MAX_WORKERS) workers = BATCH_MAX_WORKERS;
+	batch_threads = (cores > workers) ? cores / workers : 1;
+
+	shared = mmap(NULL, sizeof(batch_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared == MAP_FAILED) {
+		fprintf(stderr, "Error mapping shared memory\n");
+		return EXIT_FAILURE;
+	}
+	fflush(stdout);
+	start = trace_now_ns();
+	for(i = 0; i < workers; i++) {
+		pid_t pid = fork();
+		if(pid == 0) {
+			stats = &shared->workers[i];
+			exit(batch_worker());
+		}
+		if(pid < 0) {
+			fprintf(stderr, "Error starting worker %d\n", i);
+			workers = i;
+			break;
+		}
+	}
+	while(wait(NULL) > 0);
+	total = trace_now_ns() - start;
+
+	for(i = 0; i < workers; i++) {
+		batch_stats *w = &shared->workers[i];
+		sum.images += w->images;
+		sum.unreadable += w->unreadable;
+		sum.unwritable += w->unwritable;
+		sum.load_ns += w->load_ns;
+		sum.compute_ns += w->compute_ns;
+		sum.write_ns += w->write_ns;
+	}
+	fprintf(stderr, "%d images in %.3f s, %.1f images/s, %d workers x %d threads\n",
+		sum.images, total / 1e9, sum.images / (total / 1e9), workers, batch_threads);
+	if(sum.images > 0) {
+		fprintf(stderr, "  load    %8.3f ms/image\n", sum.load_ns / 1e6 / sum.images);
+		fprintf(stderr, "  compute %8.3f ms/image\n", sum.compute_ns / 1e6 / sum.images);
+		fprintf(stderr, "  write   %8.3f ms/image\n", sum.write_ns / 1e6 / sum.images);
+	}
+	if(sum.unreadable + sum.unwritable > 0) {
+		fprintf(stderr, "  %d inputs could not be read, %d results could not be written\n",
+			sum.unreadable, sum.unwritable);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#elif !defined(BENCH)
+
+/*
+ * Frames are computed on a worker thread into one of three buffers and the
+ * GLUT thread presents the newest finished one. The buffers are handed over
+ * lock free, worker and display() each own one index and swap theirs with
+ * middle_frame, FRAME_FRESH marks a middle buffer not yet presented.
+ * The mutex is only used to put an idle worker to sleep.
+ */
+#define FRAME_COUNT 3
+#define FRAME_FRESH 4
+#define POLL_MS 4
+
+pixel frames[FRAME_COUNT][TEX_SIZE][TEX_SIZE];
+
+int frame_generation[FRAME_COUNT];
+
+atomic_int middle_frame = 1;
+
+int back_frame = 2; // owned by the worker
+
+int front_frame = 0; // owned by display()
+
+int presented_generation = -1;
+
+int polling = 0;
+
+pthread_t worker;
+
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+// Settings changed by the keyboard, only the GLUT thread touches them
+frame_settings edited;
+
+// Copy of edited for the newest job, guarded by job_lock
+frame_settings requested;
+
+void *frame_worker(void *arg) {
+	int done_generation = -1;
+
+	for(;;) {
+		pthread_mutex_lock(&job_lock);
+		while(atomic_load(&job_generation) == done_generation) {
+			pthread_cond_wait(&job_cond, &job_lock);
+		}
+		worker_generation = atomic_load(&job_generation);
+		settings = requested;
+		pthread_mutex_unlock(&job_lock);
+
+		TRACE_BEGIN(t_compute);
+		result = frames[back_frame];
+		compute_frame();
+		TRACE_END(t_compute, mode_stage[settings.mode], 1);
+
+		// A key was pressed meanwhile, drop the frame and start over
+		if(job_stale()) continue;
+
+		frame_generation[back_frame] = worker_generation;
+		back_frame = atomic_exchange(&middle_frame, back_frame | FRAME_FRESH) & ~FRAME_FRESH;
+		done_generation = worker_generation;
+	}
+	return NULL;
+}
+
+// Waits for the worker on the GLUT thread, stops once the newest frame is shown
+void poll_worker(int value) {
+	if(atomic_load(&middle_frame) & FRAME_FRESH) {
+		glutPostRedisplay();
+	}
+	if(presented_generation != atomic_load(&job_generation)) {
+		glutTimerFunc(POLL_MS, poll_worker, 0);
+	} else {
+		polling = 0;
+	}
+}
+
+// Cancels the frame in flight and asks the worker for a new one
+void request_redraw() {
+	pthread_mutex_lock(&job_lock);
+	requested = edited;
+	atomic_fetch_add(&job_generation, 1);
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	if(!polling) {
+		polling = 1;
+		glutTimerFunc(POLL_MS, poll_worker, 0);
+	}
+}
 
 /*
  * Handles keyboard input, switch modes by char 'm' and 
  * controll chars for variations are q,w,e,r,t,z,u,i
  * in layers you can use a and d to move animation
+ * p changes the seed of random dithering, f selects motion blur
+ * g selects gaussian blur, its sigma is changed by + and -
+ * j selects median and k bilateral filter
+ * l cycles erode, dilate, open, close and none after the reducer
+ * h selects histogram equalization, c CLAHE and n auto levels
+ * v switches reducer thresholds between adaptive and fixed
+ * y runs sharpen, edge detection and emboss on luminance only
+ * the last mode chains the selected effect and reducer
  */
 void handle_keyboard(unsigned char ch, int x, int y) {
     switch(ch) {
         case 'q':
-            effect = blur;
-			reduce = to_3bit;
+            edited.effect = FRAME_STAGE(blur);
+			edited.reduce = LEVELS_STAGE(to_3bit);
             break;
         case 'w':
-            effect = sharpen;
-			reduce = to_1bit;
+            edited.effect = FRAME_STAGE(sharpen);
+			edited.reduce = LEVELS_STAGE(to_1bit);
             break;
         case 'e':
-            effect = edge_detection1;
-			reduce = to_8bit;
+            edited.effect = FRAME_STAGE(edge_detection1);
+			edited.reduce = POINT_STAGE(to_8bit);
             break;
 		case 'r':
-			effect = edge_detection3;
-			reduce = random_dithering_1bit;
+			edited.effect = FRAME_STAGE(edge_detection3);
+			edited.reduce = POINT_STAGE(random_dithering_1bit);
 			break;
 		case 't':
-			effect = blur5x;
-			reduce = random_dithering_8bit;
+			edited.effect = FRAME_STAGE(blur5x);
+			edited.reduce = POINT_STAGE(random_dithering_8bit);
 			break;
 		case 'z':
-			effect = emboss;
-			reduce = ordered_dithering_1bit;
+			edited.effect = FRAME_STAGE(emboss);
+			edited.reduce = LEVELS_STAGE(ordered_dithering_1bit);
 			break;
 		case 'u':
-			effect = to_grayscale;
-			reduce = ordered_dithering_8bit;
+			edited.effect = POINT_STAGE(to_grayscale);
+			edited.reduce = POINT_STAGE(ordered_dithering_8bit);
 			break;
 		case 'i':
-			reduce = error_diff_dither_1bit;
+			edited.reduce = FRAME_STAGE(error_diff_dither_1bit);
 			break;
 		case 'o':
-			reduce = error_diff_dither_8bit;
-			to_grayscale(result);
+			edited.reduce = FRAME_STAGE(error_diff_dither_8bit);
 		case 'a':
-			if(alpha_x < 255) {
-				alpha_x++;
+			if(edited.alpha_x < 255) {
+				edited.alpha_x++;
 			}
 			break;
 		case 'd':
-			if(alpha_x > 0) {
-				alpha_x--;
+			if(edited.alpha_x > 0) {
+				edited.alpha_x--;
 			}
 			break;
+		case 'p':
+			edited.dither_seed++;
+			break;
+		case 'f':
+			edited.effect = FRAME_STAGE(motion_blur);
+			break;
+		case 'g':
+			edited.effect = FRAME_STAGE(gaussian_blur);
+			break;
+		case 'j':
+			edited.effect = FRAME_STAGE(median_filter);
+			break;
+		case 'k':
+			edited.effect = FRAME_STAGE(bilateral_filter);
+			break;
+		case 'l':
+			edited.morph_op = (edited.morph_op == MORPH_CLOSE) ? MORPH_NONE : edited.morph_op + 1;
+			break;
+		case 'h':
+			edited.effect = FRAME_STAGE(equalize);
+			break;
+		case 'c':
+			edited.effect = FRAME_STAGE(clahe);
+			break;
+		case 'n':
+			edited.effect = FRAME_STAGE(auto_levels);
+			break;
+		case 'v':
+			edited.adaptive_levels = !edited.adaptive_levels;
+			break;
+		case 'y':
+			edited.ycc_filtering = !edited.ycc_filtering;
+			break;
+		case '+':
+			edited.gauss_sigma *= 1.5;
+			break;
+		case '-':
+			if(edited.gauss_sigma > 0.75) edited.gauss_sigma /= 1.5;
+			break;
 		case 'm':
-			if(mode == DISPLAY_TO_LESSBIT) {
-				mode = DISPLAY_EFFECT;
+			if(edited.mode == DISPLAY_CHAIN) {
+				edited.mode = DISPLAY_EFFECT;
 			} else {
-				mode++;
+				edited.mode++;
 			}
 			break;
     }
 
-	reduced = 0;
+	request_redraw();
 }
 
 // Initialize OpenGL state
@@ -584,42 +3111,34 @@ void init() {
     gluOrtho2D(-1,1,-1,1);
     glLoadIdentity();
     glColor3f(1,1,1);
-    load_rgb(source, "image.rgb", TEX_SIZE);
-	load_rgba(layer1,"image.rgba", TEX_SIZE);
-	load_rgba(layer2, "top.rgba", TEX_SIZE);
+	load_images();
+	edited = settings;
+	edited.effect = FRAME_STAGE(sharpen);
+	edited.reduce = LEVELS_STAGE(to_1bit);
+	requested = edited;
 
+	// Source stays in the upper half, results are replaced by glTexSubImage2D
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TEX_SIZE, 2*TEX_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+	pthread_create(&worker, NULL, frame_worker, NULL);
+	request_redraw();
 }
 
 // Generate and display the image.
 void display() {
-    // Call user image generation
-	
-	switch(mode) {
-		case DISPLAY_LAYERS:
-			reduced = 0;
-			memcpy(*result, *source, TEX_SIZE*TEX_SIZE*sizeof(pixel));
-			blend_layer_at(result, layer1, alpha_x, 0);
-			blend_layer_at(result, layer2, 50, 50);
-			break;
-		case DISPLAY_EFFECT:
-			reduced = 0;
-			effect();
-			break;
-		case DISPLAY_FRACTAL:
-			reduced = 0;
-			print_fractal();
-			break;
-		case DISPLAY_TO_LESSBIT:
-			if(!reduced) {
-				reduce();
-				reduced = 1;
-			}
-			break;
+	TRACE_FRAME_BEGIN();
+	// Take the newest frame from the worker, without one (e.g. window was
+	// exposed) the texture still holds the last frame so just present again
+	if(atomic_load(&middle_frame) & FRAME_FRESH) {
+		front_frame = atomic_exchange(&middle_frame, front_frame) & ~FRAME_FRESH;
+		presented_generation = frame_generation[front_frame];
+
+		// Copy image to texture memory
+		TRACE_BEGIN(t_upload);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, TEX_SIZE, TEX_SIZE, TEX_SIZE, GL_RGB, GL_UNSIGNED_BYTE, frames[front_frame]);
+		TRACE_END(t_upload, "upload", 0);
 	}
-
-    // Copy image to texture memory
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TEX_SIZE, 2*TEX_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+	TRACE_BEGIN(t_present);
     // Clear screen buffer
     glClear(GL_COLOR_BUFFER_BIT);
     // Render a quad
@@ -631,12 +3150,14 @@ void display() {
     glEnd();
     // Display result
     glFlush();
-    glutPostRedisplay();
     glutSwapBuffers();
+	TRACE_END(t_present, "present", 0);
+	TRACE_FRAME_END();
 }
 
 // Main entry function
 int main(int argc, char ** argv) {
+	trace_init("gradient");
     // Init GLUT
     glutInit(&argc, argv);
     glutInitWindowSize(TEX_SIZE, 2*TEX_SIZE);
@@ -650,3 +3171,135 @@ int main(int argc, char ** argv) {
     glutMainLoop();
     return EXIT_SUCCESS;
 }
+
+#else
+
+#include "bench.h"
+
+#define BENCH_PX (TEX_SIZE*TEX_SIZE)
+
+frame_fn bench_fn;
+
+pipeline bench_pipe;
+
+frame_pool bench_pool;
+
+void bench_call() {
+	bench_fn(source, result);
+}
+
+void bench_stage(const char *name, frame_fn fn, int reps) {
+	bench_fn = fn;
+	bench_run(name, bench_call, BENCH_PX, "px", reps, 1);
+}
+
+void bench_luma() {
+	source_version++;
+	luma_plane(source);
+}
+
+#define BENCH_WIDE_W 900
+#define BENCH_WIDE_H 700
+
+GLubyte *bench_wide;
+
+// Scales a 900x700 copy of source back to TEX_SIZE as the loader would
+void bench_resample() {
+	resample(bench_wide, BENCH_WIDE_W, BENCH_WIDE_H, &result[0][0].r, TEX_SIZE, TEX_SIZE, 3, resample_filter);
+}
+
+void bench_ycc() {
+	source_version++;
+	ycc_planes(source);
+}
+
+void bench_histogram() {
+	static image_hist hist;
+	image_histogram(source, &hist);
+}
+
+void bench_pipe_run() {
+	pipe_run(&bench_pipe, &bench_pool, source, result);
+}
+
+// Runs a chain of point stages once fused and once stage by stage
+void bench_chain(const char *name, int fused) {
+	pipe_clear(&bench_pipe);
+	pipe_add(&bench_pipe, POINT_STAGE(blend_layers));
+	pipe_add(&bench_pipe, POINT_STAGE(to_grayscale));
+	pipe_add(&bench_pipe, POINT_STAGE(ordered_dithering_8bit));
+	if(!fused) {
+		int i;
+		for(i = 0; i < bench_pipe.len; i++) bench_pipe.stages[i].point = NULL;
+	}
+	bench_run(name, bench_pipe_run, BENCH_PX, "px", 31, 1);
+}
+
+// Benchmarks every effect and reducer on the bundled images (make bench)
+int main(int argc, char ** argv) {
+	char *json = getenv("BENCH_JSON");
+
+	load_images();
+
+	bench_stage("blur", blur, 15);
+	bench_stage("blur5x", blur5x, 15);
+	bench_stage("edge_detection1", edge_detection1, 15);
+	bench_stage("edge_detection3", edge_detection3, 15);
+	bench_stage("sharpen", sharpen, 15);
+	bench_stage("emboss", emboss, 15);
+	settings.ycc_filtering = 1;
+	bench_stage("sharpen (ycc)", sharpen, 15);
+	bench_stage("emboss (ycc)", emboss, 15);
+	bench_run("rgb_to_ycc", bench_ycc, BENCH_PX, "px", 31, 1);
+	settings.ycc_filtering = 0;
+	bench_stage("motion_blur", motion_blur, 5);
+	bench_stage("median_filter r3", median_filter, 15);
+	filter_radius = 15;
+	bench_stage("median_filter r15", median_filter, 15);
+	filter_radius = 3;
+	bench_stage("bilateral_filter r3", bilateral_filter, 15);
+	bench_stage("erode (color)", erode, 15);
+	to_1bit(source, source);
+	source_version++;
+	bench_stage("erode (1-bit packed)", erode, 15);
+	morph_size = 31;
+	bench_stage("erode 31 (1-bit packed)", erode, 15);
+	load_images();
+	bench_stage("erode 31 (color)", erode, 15);
+	morph_size = 5;
+	settings.gauss_sigma = 2;
+	bench_stage("gaussian_blur sigma 2", gaussian_blur, 15);
+	settings.gauss_sigma = 32;
+	bench_stage("gaussian_blur sigma 32", gaussian_blur, 15);
+	bench_stage("to_grayscale", to_grayscale, 31);
+	bench_run("image_histogram", bench_histogram, BENCH_PX, "px", 31, 1);
+	bench_stage("equalize", equalize, 31);
+	bench_stage("clahe", clahe, 31);
+	bench_stage("auto_levels", auto_levels, 31);
+	bench_run("luma_plane", bench_luma, BENCH_PX, "px", 31, 1);
+	bench_stage("to_3bit", to_3bit, 31);
+	bench_stage("to_1bit", to_1bit, 31);
+	bench_stage("to_8bit", to_8bit, 31);
+	bench_stage("random_dithering_1bit", random_dithering_1bit, 31);
+	bench_stage("random_dithering_8bit", random_dithering_8bit, 31);
+	bench_stage("ordered_dithering_1bit", ordered_dithering_1bit, 31);
+	bench_stage("ordered_dithering_8bit", ordered_dithering_8bit, 31);
+	bench_stage("error_diff_dither_1bit", error_diff_dither_1bit, 15);
+	bench_stage("error_diff_dither_8bit", error_diff_dither_8bit, 15);
+	bench_stage("blend_layers", blend_layers, 31);
+	bench_wide = malloc(BENCH_WIDE_W * BENCH_WIDE_H * 3);
+	resample(&source[0][0].r, TEX_SIZE, TEX_SIZE, bench_wide, BENCH_WIDE_W, BENCH_WIDE_H, 3, RESAMPLE_BILINEAR);
+	resample_filter = RESAMPLE_BILINEAR;
+	bench_run("resample bilinear 900x700", bench_resample, BENCH_PX, "px", 15, 1);
+	resample_filter = RESAMPLE_LANCZOS;
+	bench_run("resample lanczos 900x700", bench_resample, BENCH_PX, "px", 15, 1);
+	free(bench_wide);
+	bench_stage("print_fractal", print_fractal, 5);
+	bench_chain("chain blend>gray>ord8", 0);
+	bench_chain("chain fused", 1);
+
+	bench_report("gradient", json ? json : "gradient_bench.json");
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -11,7 +11,13 @@
 #include <string.h>
 #include <time.h>
 
-#ifdef __APPLE__
+#include "frame_trace.h"
+
+#ifdef HEADLESS
+  //Bez okna sa GL nelinkuje ani neinkluduje, staci mat rovnake typy
+  typedef unsigned char GLubyte;
+  typedef unsigned int GLuint;
+#elif defined(__APPLE__)
   #include <GLUT/glut.h>
 #else
   #include <GL/freeglut.h>
@@ -19,18 +25,33 @@
 #endif
 
 #define TEX_SIZE 512
+#define TILE 32 //Vyska pasu (pocet riadkov) pri kresleni tahov
+#define TILES (TEX_SIZE / TILE)
 #define C_RED 0
 #define C_GREEN 1
 #define C_BLUE 2
 
-#define BZ_STEP 5 //Presnosť kreslenia bezierovej krivky
+#define BZ_TOLERANCE 0.25 //Najvacsia odchylka vyrovnanej krivky v pixeloch
+#define BZ_MAX_SEGS 256 //Najviac segmentov na jednu krivku
 #define BZ_PTS 3
 #define max(x, y) (((x) > (y)) ? (x) : (y))
 #define min(x, y) (((x) < (y)) ? (x) : (y))
 #define ANGLE 0.01
+#define TARGET_FPS 60 //Predvolena rychlost animacie, meni sa cez TARGET_FPS
+#define CAP_ROUND 0 //Okruhle konce a spoje ciar
+#define CAP_SQUARE 1 //Stvorcove konce a spoje ciar
+#define FILL_NONZERO 0 //Pixel je vnutri ak je vinutie nenulove
+#define FILL_EVENODD 1 //Pixel je vnutri ak obrys pretne neparny pocet krat
+#define NEAR_Z 16 //Blizka rovina kamery, krivky blizsie sa orezu
 
 int animation = 0;
 
+//1 ak sa objekt kresli ako vyplneny tvar namiesto obrysu
+int fill_mode = 0;
+
+//Nastavi sa ked sa obraz zmenil a treba ho znova nakreslit
+int dirty = 1;
+
 typedef struct {
     GLubyte r;
     GLubyte g;
@@ -42,6 +63,14 @@ typedef struct {
  * - new_pt
  * - pt_set
  * - ln_dw_sub
+ * - ln_describe, ln_gpt, bz_get_desc (krivky sa vyrovnavaju cez bz_flatten)
+ * - bz_divw (delenie w robi soa_transform)
+ * - mrx_pt (body po jednom nahradil davkovy soa_transform)
+ * - obj_copy, obj_free (transformacie menia len maticu, kopie netreba)
+ * - obj_pose (body transformuje obj_project rovno do obj->screen)
+ * - obj_persp (projekcia sa robi do obj->screen cez obj_project)
+ * - dw_pt, new_ln (ciary sa kreslia ako tahy cez stroke_segment)
+ * - point (body sa nekreslia, ciary maju vlastne spany)
  */
 
 /*
@@ -60,18 +89,6 @@ typedef struct {
 	pt pt2;
 } ln;
 
-//Popis ciary, aby som si nemusel niektore veci
-//pocitat furt od znova
-typedef struct {
-	float min_x;
-	float min_y;
-	float len_x; //len - dlzka cize (max_x - min_x)
-	float len_y;
-	float len; //Dlzka max(len_x, len_y)
-	float pomer; //min(len_x, len_y)/max(len_x, len_y)
-	short longer_x; //ci je len_x viac ako len_y
-} ln_desc;
-
 //Bezierova krivka 
 //je definovana troma bodmy
 typedef struct {
@@ -80,23 +97,51 @@ typedef struct {
 	pt pt3;
 } bz;
 
-//Popis
+//Bod v rovine obrazovky
+typedef struct {
+	float x;
+	float y;
+} vec2;
+
+//Vyrovnane krivky objektu, krivka i su body ends[i-1]..ends[i]-1
 typedef struct {
-	float step_1; //dlzka kroku na prvej ciare
-	float step_2; //dlzka kroku na druhej ciare
-	float len; //dlzka, koľko krokov podla BZ_STEP je potrebnych na nakreselenie bz
-	ln *ln1; //ciara z pt1 do pt2
-	ln *ln; //ciara z pt2 do pt3
-	ln_desc ldc1; //popis ciary z pt1 do pt2
-	ln_desc ldc2; //popis ciary z pt2 do pt3
-} bz_desc;
+	int valid; //0 ak sa objekt od vyrovnania zmenil
+	int len; //Pocet bodov
+	int cap;
+	vec2 *pts;
+	int curves;
+	int ends_cap;
+	int *ends;
+} flat_path;
+
+//Body ako SoA (zvlast pole pre kazdu suradnicu), dlzka zarovnana na 4
+typedef struct {
+	int len;
+	int cap;
+	float *x;
+	float *y;
+	float *z;
+	float *w;
+} pt_soa;
 
 //Objekt, je v nom ulozeny uz kompletny tvar npr. pismeno R
+//krivky su v klidovej polohe, vsetky transformacie su zlozene v matrix
 typedef struct {
 	int len; //Pocet bezierovych kriviek
+	float matrix[4][4]; //Zlozena transformacia objektu
+	pt_soa rest; //Riadiace body klidovej polohy pre davkove transformacie
+	bz *screen; //Body po projekcii na obrazovku, alokuje sa raz (2 * len, orezanie moze krivku rozdelit)
+	int screen_len; //Pocet premietnutych kriviek po orezani blizkou rovinou
+	float screen_d; //Vzdialenost kamery pre ktoru su screen platne
+	int screen_valid; //0 ak sa objekt od projekcie zmenil
+	int bound_valid; //1 ak je bound spocitana
+	float bound[4]; //Obalova gula klidovej polohy, stred x, y, z a polomer
+	flat_path flat; //Cache vyrovnanych kriviek
 	bz curves[]; //Krivky
 } obj;
 
+#define M_IDENTITY {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}}
+
 pixel image[TEX_SIZE][TEX_SIZE];
 
 GLuint texture;
@@ -105,6 +150,7 @@ int pen_red = 0;
 int pen_green = 0;
 int pen_blue = 0;
 int pen_width = 0;
+int pen_cap = CAP_ROUND;
 
 //Basic functions
 
@@ -142,6 +188,10 @@ void pen_set(int red, int green, int blue, int width) {
 	pen_set_width(width);
 }
 
+void pen_set_cap(int cap) {
+	pen_cap = cap;
+}
+
 //Premaluje celu plochu farbou pera
 void bucket_fill(pixel canvas[TEX_SIZE][TEX_SIZE]) {
 	int x, y;
@@ -152,498 +202,1361 @@ void bucket_fill(pixel canvas[TEX_SIZE][TEX_SIZE]) {
 	}
 }
 
-//Vykresli jeden bod na suradniciach x, y farbou pera o velkosti pera
-void point(pixel canvas[TEX_SIZE][TEX_SIZE], int x, int y) {
-	int min_x, min_y, max_x, max_y, i_y;
-	min_x = get_between(0, TEX_SIZE, floor(x-(pen_width/2)));
-	min_y = get_between(0, TEX_SIZE, floor(y-(pen_width/2)));
-	max_x = get_between(0, TEX_SIZE, ceil(x+(pen_width/2)));
-	max_y = get_between(0, TEX_SIZE, ceil(y+(pen_width/2)));
+//Obdlznik na platni, riadky x0..x1 a stlpce y0..y1 vratane, prazdny ak x0 > x1
+typedef struct {
+	int x0, y0, x1, y1;
+} box;
 
-	while(min_x++ < max_x) {
-		for(i_y = min_y; i_y < max_y; i_y++) {
-			set_color(&canvas[min_x][i_y], pen_red, pen_green, pen_blue);
-		}
+#define BOX_EMPTY {TEX_SIZE, TEX_SIZE, -1, -1}
+
+//Co sa na platni nakreslilo od posledneho canvas_clear
+box drawn = BOX_EMPTY;
+
+//Farba ktorou je platna zmazana, pozadie mimo drawn ma vzdy tuto farbu
+pixel background;
+int background_valid = 0;
+
+//Rozsiri obdlznik o usek y0..y1 v riadku x
+static inline void box_add(box *b, int x, int y0, int y1) {
+	b->x0 = min(b->x0, x);
+	b->x1 = max(b->x1, x);
+	b->y0 = min(b->y0, y0);
+	b->y1 = max(b->y1, y1);
+}
+
+//Rozsiri drawn o usek y0..y1 v riadku x
+static inline void drawn_add(int x, int y0, int y1) {
+	box_add(&drawn, x, y0, y1);
+}
+
+//Vyplni obdlznik farbou, prvy riadok po pixeloch a ostatne ho len skopiruju
+void box_fill(pixel canvas[TEX_SIZE][TEX_SIZE], box b, pixel color) {
+	int x, y, bytes = (b.y1 - b.y0 + 1) * sizeof(pixel);
+	if(b.x0 > b.x1 || b.y0 > b.y1) return;
+	for(y = b.y0; y <= b.y1; y++) canvas[b.x0][y] = color;
+	for(x = b.x0 + 1; x <= b.x1; x++) {
+		memcpy(&canvas[x][b.y0], &canvas[b.x0][b.y0], bytes);
 	}
 }
 
-//To co predtim, akurat pracuje zo strukturov pt - point - bod
-void dw_pt(pt* pt) {
-	point(image, pt->x, pt->y);
-}
-
-//Vytvory popis ciary (ln_desc)
-ln_desc ln_describe(ln *ln) {
-	ln_desc dc;
-	dc.len_x = abs(ln->pt1.x - ln->pt2.x);
-	dc.len_y = abs(ln->pt1.y - ln->pt2.y);
-	dc.min_x = min(ln->pt1.x, ln->pt2.x);
-	dc.min_y = min(ln->pt1.y, ln->pt2.y);
-	dc.longer_x = (dc.len_x > dc.len_y);
-	dc.len = (dc.len_x > dc.len_y) ? dc.len_x : dc.len_y;
-	dc.pomer = (dc.longer_x) ? (float)dc.len_y/dc.len_x : (float)dc.len_x/dc.len_y;
-	return dc;
-}
-
-//Z dvoch bodov vytvori ciaru (funkcia len na setrenie miesta)
-ln new_ln(pt pt1, pt pt2) {
-	ln line;
-	line.pt1 = pt1;
-	line.pt2 = pt2;
-	return line;
-}
-
-//ln_gpt - line_get_point vrati num-ty bod ciary
-//ide po suradnici na ktorej je ciara dlhsia (max(len_x, len_y))
-//ak je prvy bod dlhzsej len minimalny danej len tak num pripocitava
-//inak num odpocitava od max danej len
-pt ln_gpt(ln *ln, ln_desc *dc, int num) {
-	pt result;
-	int desc;
-	if(dc->longer_x) {
-		desc = ceil(num*dc->pomer);
-		result.x = (ln->pt1.x == dc->min_x) ? dc->min_x + num : max(ln->pt1.x, ln->pt2.x) - num;
-		result.y = (ln->pt1.y == dc->min_y) ? dc->min_y + desc : max(ln->pt1.y, ln->pt2.y) - desc;
+//Zmaze platnu farbou pera, prepise len obdlznik nakresleny od posledneho
+//mazania, takze cena zavisi od nakreslenej plochy a nie od velkosti platne
+//celu plochu premaluje len prvy raz alebo ked sa zmeni farba pozadia
+void canvas_clear(pixel canvas[TEX_SIZE][TEX_SIZE]) {
+	pixel color;
+	box all = {0, 0, TEX_SIZE - 1, TEX_SIZE - 1};
+
+	set_color(&color, pen_red, pen_green, pen_blue);
+	if(!background_valid || memcmp(&color, &background, sizeof(pixel)) != 0) {
+		box_fill(canvas, all, color);
+		background = color;
+		background_valid = 1;
 	} else {
-		desc = ceil(num*dc->pomer);
-		result.x = (ln->pt1.x == dc->min_x) ? dc->min_x + desc : max(ln->pt1.x, ln->pt2.x) - desc;
-		result.y = (ln->pt1.y == dc->min_y) ? dc->min_y + num : max(ln->pt1.y, ln->pt2.y) - num;
+		box_fill(canvas, drawn, color);
 	}
-	return result;
+	drawn = (box)BOX_EMPTY;
 }
 
-//Vykresli ciaru ln_dw - line_draw
-void ln_dw(ln* ln) {
-	int i;
-	ln_desc dc = ln_describe(ln); //ziska popis
-	pt pt;
-	for(i=0; i<dc.len; i++) { //cikly cez dlhsiu suradnicu
-		pt = ln_gpt(ln, &dc, i); //ziskaj bod
-		dw_pt(&pt); //vykresli
-	}
-}
-
-//Ziskaj popis bezierovej krivky
-bz_desc bz_get_desc(bz *bz) {
-	bz_desc desc;
-	//struktura bezierovej krivky su tri body a krivka dve
-	//takze aby som ziskal dve ciary z bezierovej krivky
-	//staci pretipovat odkazi na konkretne body
-	desc.ln1 = (ln*)bz; //toto je v podstate odkaz na prvy bod bz
-	desc.ln = (ln*)&bz->pt2;
-	desc.ldc1 = ln_describe(desc.ln1); //ziska popisis ciar
-	desc.ldc2 = ln_describe(desc.ln);
-
-	//vypocet dlzky krokov a pocet krokov potrebny na nakreslenie bz
-	if(desc.ldc1.len > desc.ldc2.len) {
-		desc.step_1 = BZ_STEP;
-		desc.len = desc.ldc1.len/BZ_STEP;
-		desc.step_2 = desc.ldc2.len/desc.len;
-	} else {
-		desc.step_2 = BZ_STEP;
-		desc.len = desc.ldc2.len/BZ_STEP;
-		desc.step_1 = desc.ldc1.len/desc.len;
+/*
+ * Hrube ciary cez spany (useky riadku). Kazdy segment ciary je konvexny
+ * utvar, obdlznik s polkruhmi na koncoch (CAP_ROUND) alebo obdlznik
+ * predlzeny o polovicu pera (CAP_SQUARE), takze v kazdom riadku x pokryva
+ * jeden usek y0..y1. Useky vsetkych segmentov tahu sa zozbieraju, zoradia
+ * podla riadku, spoja a kazdy pixel sa zapise prave raz. Spoje segmentov
+ * maju rovnaky tvar ako konce.
+ *
+ * Kreslenie ma dve fazy. Najprv sa segmenty tahu roztriedia do dlazdic,
+ * pasov po TILE riadkov cez celu sirku, podla riadkov ktore pokryju aj
+ * s hrubkou pera. Potom sa dlazdice rasterizuju paralelne, kazda dlazdica
+ * patri jednemu vlaknu, ktore zapisuje len do jej pixelov, takze platna
+ * nepotrebuje zamky. Segmenty v dlazdici ostavaju v poradi v akom boli
+ * pridane a useky sa orezu na dlazdicu, vysledok je rovnaky ako pri
+ * kresleni celej platne naraz. Dlazdice su cele pasy preto, lebo useky sa
+ * pocitaju po riadkoch, pri stvorcovych dlazdiciach by kazda dlazdica v tom
+ * istom pase pocitala tie iste riadky segmentu znova.
+ */
+typedef struct {
+	short x; //riadok
+	short y0; //prvy pixel
+	short y1; //posledny pixel
+} span;
+
+//Useky jednej dlazdice, kazde vlakno ma vlastny
+typedef struct {
+	int len;
+	int cap;
+	span *spans;
+	span *sorted;
+	int rows[TILE + 1]; //zaciatky riadkov dlazdice v sorted
+} span_buf;
+
+typedef struct {
+	float x0, y0, x1, y1;
+} segment;
+
+//Segmenty tahu a ich rozdelenie do dlazdic
+typedef struct {
+	int len;
+	int cap;
+	segment *segs;
+	int bins_cap;
+	int *bins; //indexy segmentov zoradene podla dlazdic
+	int tiles[TILES + 1]; //zaciatky dlazdic v bins
+	box drawn[TILES]; //co sa v dlazdici nakreslilo
+} stroke_buf;
+
+stroke_buf stroke = {0, 0, NULL, 0, NULL};
+
+static span_buf tile_spans = {0, 0, NULL, NULL};
+#pragma omp threadprivate(tile_spans)
+
+void stroke_begin() {
+	stroke.len = 0;
+}
+
+//Prida usek orezany na dlazdicu clip, pole sa zvacsuje len ked nestaci, v ustalenom stave nealokuje
+static void stroke_span(span_buf *buf, box clip, int x, float lo, float hi) {
+	int y0 = ceil(lo), y1 = (int)ceil(hi) - 1;
+	if(x < clip.x0 || x > clip.x1) return;
+	y0 = max(y0, clip.y0);
+	y1 = min(y1, clip.y1);
+	if(y0 > y1) return;
+	if(buf->len == buf->cap) {
+		buf->cap = buf->cap ? 2 * buf->cap : 1024;
+		buf->spans = realloc(buf->spans, buf->cap * sizeof(span));
+		buf->sorted = realloc(buf->sorted, buf->cap * sizeof(span));
 	}
+	buf->spans[buf->len++] = (span){x, y0, y1};
+}
 
-	return desc;
+//Rozsah y konvexneho mnohouholnika c[0..n-1] v riadku x, 0 ak ho riadok nepretne
+static int poly_row(float c[][2], int n, float x, float *lo, float *hi) {
+	int i, hit = 0;
+	for(i = 0; i < n; i++) {
+		float *a = c[i], *b = c[(i + 1) % n], y;
+		if((a[0] - x) * (b[0] - x) > 0) continue;
+		if(a[0] == b[0]) {
+			*lo = hit ? min(*lo, min(a[1], b[1])) : min(a[1], b[1]);
+			*hi = hit ? max(*hi, max(a[1], b[1])) : max(a[1], b[1]);
+		} else {
+			y = a[1] + (x - a[0]) * (b[1] - a[1]) / (b[0] - a[0]);
+			*lo = hit ? min(*lo, y) : y;
+			*hi = hit ? max(*hi, y) : y;
+		}
+		hit = 1;
+	}
+	return hit;
 }
 
-//vykresli bezierovu krivku bz_dw - bezier_draw
-void bz_dw(bz *bz) {
-	bz_desc desc = bz_get_desc(bz);
+//Useky jedneho segmentu s hrubkou pera v dlazdici clip
+static void segment_spans(span_buf *buf, box clip, segment *seg) {
+	float x0 = seg->x0, y0 = seg->y0, x1 = seg->x1, y1 = seg->y1;
+	float r = max(pen_width, 1) / 2.0;
+	float dx = x1 - x0, dy = y1 - y0, len = sqrt(dx*dx + dy*dy);
+	float ux = (len > 0) ? dx / len : 1, uy = (len > 0) ? dy / len : 0;
+	float ext = (pen_cap == CAP_SQUARE) ? r : 0;
+	float c[4][2] = {
+		{x0 - ux*ext - uy*r, y0 - uy*ext + ux*r},
+		{x1 + ux*ext - uy*r, y1 + uy*ext + ux*r},
+		{x1 + ux*ext + uy*r, y1 + uy*ext - ux*r},
+		{x0 - ux*ext + uy*r, y0 - uy*ext - ux*r}
+	};
+	float min_x = c[0][0], max_x = c[0][0];
+	int i, x;
+
+	for(i = 1; i < 4; i++) {
+		min_x = min(min_x, c[i][0]);
+		max_x = max(max_x, c[i][0]);
+	}
+	if(pen_cap == CAP_ROUND) {
+		min_x = min(x0, x1) - r;
+		max_x = max(x0, x1) + r;
+	}
+	for(x = max(ceil(min_x), clip.x0); x < ceil(max_x) && x <= clip.x1; x++) {
+		float lo = 0, hi = 0, h;
+		int hit = (len > 0 || pen_cap == CAP_SQUARE) ? poly_row(c, 4, x, &lo, &hi) : 0;
+		if(pen_cap == CAP_ROUND) {
+			if(fabs(x - x0) < r) {
+				h = sqrt(r*r - (x - x0)*(x - x0));
+				lo = hit ? min(lo, y0 - h) : y0 - h;
+				hi = hit ? max(hi, y0 + h) : y0 + h;
+				hit = 1;
+			}
+			if(fabs(x - x1) < r) {
+				h = sqrt(r*r - (x - x1)*(x - x1));
+				lo = hit ? min(lo, y1 - h) : y1 - h;
+				hi = hit ? max(hi, y1 + h) : y1 + h;
+				hit = 1;
+			}
+		}
+		if(hit) stroke_span(buf, clip, x, lo, hi);
+	}
+}
+
+//Oreze usecku na obdlznik lo..hi v oboch suradniciach (Liang-Barsky), 0 ak je cela mimo
+static int clip_segment(float *x0, float *y0, float *x1, float *y1, float lo, float hi) {
+	float dx = *x1 - *x0, dy = *y1 - *y0, t0 = 0, t1 = 1;
+	float p[4] = {-dx, dx, -dy, dy};
+	float q[4] = {*x0 - lo, hi - *x0, *y0 - lo, hi - *y0};
 	int i;
-	pt prew = desc.ln1->pt1;
-	pt actual;
 
-	for(i=0; i<=desc.len;i++) {
-		//ziska prvy bod z obydvoch ciar bz a vytvory ciaru medzi nimy
-		ln line_md;
-		line_md.pt1 = ln_gpt(desc.ln1, &desc.ldc1, i*desc.step_1);
-		line_md.pt2 = ln_gpt(desc.ln, &desc.ldc2, i*desc.step_2);
+	for(i = 0; i < 4; i++) {
+		float t;
+		if(p[i] == 0) {
+			if(q[i] < 0) return 0;
+			continue;
+		}
+		t = q[i] / p[i];
+		if(p[i] < 0) t0 = max(t0, t);
+		else t1 = min(t1, t);
+		if(t0 > t1) return 0;
+	}
+	if(t1 < 1) {
+		*x1 = *x0 + t1 * dx;
+		*y1 = *y0 + t1 * dy;
+	}
+	if(t0 > 0) {
+		*x0 += t0 * dx;
+		*y0 += t0 * dy;
+	}
+	return 1;
+}
+
+//Prida segment do tahu, kresli sa az v stroke_end
+//segment sa oreze na platnu rozsirenu o hrubku pera, konce vzniknute orezanim
+//su od platne dalej ako r * sqrt(2), takze viditelne pixely sa nezmenia
+void stroke_segment(float x0, float y0, float x1, float y1) {
+	float m = max(pen_width, 1) / 2.0 * M_SQRT2 + 1;
+
+	if(!clip_segment(&x0, &y0, &x1, &y1, -m, TEX_SIZE - 1 + m)) return;
+	if(stroke.len == stroke.cap) {
+		stroke.cap = stroke.cap ? 2 * stroke.cap : 1024;
+		stroke.segs = realloc(stroke.segs, stroke.cap * sizeof(segment));
+	}
+	stroke.segs[stroke.len++] = (segment){x0, y0, x1, y1};
+}
+
+static inline void fill_run(pixel *row, int from, int to) {
+	pixel color = {pen_red, pen_green, pen_blue};
+	int y;
+	for(y = from; y <= to; y++) row[y] = color;
+}
+
+//Zoradi useky dlazdice podla riadkov (counting sort), spoji prekryvajuce a vyplni ich
+static void spans_fill(span_buf *buf, box clip, pixel canvas[TEX_SIZE][TEX_SIZE], box *done) {
+	int i, j, x, rows = clip.x1 - clip.x0 + 1;
+
+	memset(buf->rows, 0, sizeof(buf->rows));
+	for(i = 0; i < buf->len; i++) buf->rows[buf->spans[i].x - clip.x0 + 1]++;
+	for(x = 0; x < rows; x++) buf->rows[x + 1] += buf->rows[x];
+	for(i = 0; i < buf->len; i++) {
+		buf->sorted[buf->rows[buf->spans[i].x - clip.x0]++] = buf->spans[i];
+	}
+	//rows[x] teraz ukazuje na koniec riadku x, cize zaciatok x+1
+	for(x = rows; x > 0; x--) buf->rows[x] = buf->rows[x - 1];
+	buf->rows[0] = 0;
+
+	for(x = 0; x < rows; x++) {
+		span *row = &buf->sorted[buf->rows[x]];
+		int count = buf->rows[x + 1] - buf->rows[x];
+		int from, to;
+		if(count == 0) continue;
+		//insertion sort, v riadku je len par usekov
+		for(i = 1; i < count; i++) {
+			span tmp = row[i];
+			for(j = i; j > 0 && row[j - 1].y0 > tmp.y0; j--) row[j] = row[j - 1];
+			row[j] = tmp;
+		}
+		from = row[0].y0;
+		to = row[0].y1;
+		for(i = 1; i < count; i++) {
+			if(row[i].y0 > to + 1) {
+				fill_run(canvas[clip.x0 + x], from, to);
+				box_add(done, clip.x0 + x, from, to);
+				from = row[i].y0;
+			}
+			to = max(to, row[i].y1);
+		}
+		fill_run(canvas[clip.x0 + x], from, to);
+		box_add(done, clip.x0 + x, from, to);
+	}
+	buf->len = 0;
+}
+
+//Dlazdice t0..t1 ktore segment aj s hrubkou pera zasiahne, 0 ak je mimo platne
+//rohy stvorcovych koncov su od koncoveho bodu az r * sqrt(2)
+static int segment_tiles(segment *seg, int *t0, int *t1) {
+	float r = max(pen_width, 1) / 2.0 * M_SQRT2 + 1;
+	int x0 = floor(min(seg->x0, seg->x1) - r), x1 = ceil(max(seg->x0, seg->x1) + r);
+	if(x1 < 0 || x0 >= TEX_SIZE) return 0;
+	*t0 = max(x0, 0) / TILE;
+	*t1 = min(x1, TEX_SIZE - 1) / TILE;
+	return 1;
+}
+
+//Roztriedi segmenty do dlazdic (counting sort, poradie segmentov v dlazdici ostane)
+static void stroke_bin() {
+	int i, t, t0, t1;
+
+	memset(stroke.tiles, 0, sizeof(stroke.tiles));
+	for(i = 0; i < stroke.len; i++) {
+		if(!segment_tiles(&stroke.segs[i], &t0, &t1)) continue;
+		for(t = t0; t <= t1; t++) stroke.tiles[t + 1]++;
+	}
+	for(t = 0; t < TILES; t++) stroke.tiles[t + 1] += stroke.tiles[t];
+	if(stroke.tiles[TILES] > stroke.bins_cap) {
+		stroke.bins_cap = 2 * stroke.tiles[TILES];
+		stroke.bins = realloc(stroke.bins, stroke.bins_cap * sizeof(int));
+	}
+	for(i = 0; i < stroke.len; i++) {
+		if(!segment_tiles(&stroke.segs[i], &t0, &t1)) continue;
+		for(t = t0; t <= t1; t++) stroke.bins[stroke.tiles[t]++] = i;
+	}
+	for(t = TILES; t > 0; t--) stroke.tiles[t] = stroke.tiles[t - 1];
+	stroke.tiles[0] = 0;
+}
+
+//Nakresli tah, dlazdice sa rasterizuju paralelne
+void stroke_end(pixel canvas[TEX_SIZE][TEX_SIZE]) {
+	int t;
+
+	stroke_bin();
+	#pragma omp parallel for schedule(dynamic)
+	for(t = 0; t < TILES; t++) {
+		box clip = {t * TILE, 0, t * TILE + TILE - 1, TEX_SIZE - 1};
+		box *done = &stroke.drawn[t];
+		int i;
+
+		*done = (box)BOX_EMPTY;
+		for(i = stroke.tiles[t]; i < stroke.tiles[t + 1]; i++) {
+			segment_spans(&tile_spans, clip, &stroke.segs[stroke.bins[i]]);
+		}
+		if(tile_spans.len > 0) spans_fill(&tile_spans, clip, canvas, done);
+	}
+	for(t = 0; t < TILES; t++) {
+		if(stroke.drawn[t].x0 > stroke.drawn[t].x1) continue;
+		box_add(&drawn, stroke.drawn[t].x0, stroke.drawn[t].y0, stroke.drawn[t].y1);
+		box_add(&drawn, stroke.drawn[t].x1, stroke.drawn[t].y0, stroke.drawn[t].y1);
+	}
+	stroke.len = 0;
+}
+
+//Vykresli ciaru ln_dw - line_draw, ako jeden tah s hrubkou pera
+void ln_dw(ln* ln) {
+	stroke_begin();
+	stroke_segment(ln->pt1.x, ln->pt1.y, ln->pt2.x, ln->pt2.y);
+	stroke_end(image);
+}
+
+/*
+ * Vyrovnanie kriviek na lomene ciary. Pocet segmentov sa urci z druhej
+ * derivacie tak, aby odchylka tetivy od krivky bola najviac BZ_TOLERANCE
+ * pixelov (pre krok h je to |B''| h^2 / 8), kratke krivky maju par
+ * segmentov a dlhe viac. Body sa potom pocitaju doprednymi diferenciami,
+ * kazdy bod su len dve scitania.
+ */
+static void path_push(flat_path *path, float x, float y) {
+	if(path->len == path->cap) {
+		path->cap = path->cap ? 2 * path->cap : 256;
+		path->pts = realloc(path->pts, path->cap * sizeof(vec2));
+	}
+	path->pts[path->len++] = (vec2){x, y};
+}
+
+static int bz_segments(float dd) {
+	int n = ceil(sqrt(dd / (8 * BZ_TOLERANCE)));
+	return get_between(1, BZ_MAX_SEGS, n);
+}
 
-		ln_desc dc_md = ln_describe(&line_md);
+//Prida body kvadratickej krivky do path
+void bz_flatten(bz *bz, flat_path *path) {
+	float ax = bz->pt1.x - 2*bz->pt2.x + bz->pt3.x;
+	float ay = bz->pt1.y - 2*bz->pt2.y + bz->pt3.y;
+	int n = bz_segments(2 * sqrt(ax*ax + ay*ay)), i;
+	float h = 1.0 / n;
+	float x = bz->pt1.x, y = bz->pt1.y;
+	//B(t) = a t^2 + b t + c, prva a druha diferencia pre krok h
+	float dx = ax*h*h + 2*(bz->pt2.x - bz->pt1.x)*h;
+	float dy = ay*h*h + 2*(bz->pt2.y - bz->pt1.y)*h;
+	float ddx = 2*ax*h*h, ddy = 2*ay*h*h;
+
+	path_push(path, x, y);
+	for(i = 1; i < n; i++) {
+		x += dx;
+		y += dy;
+		dx += ddx;
+		dy += ddy;
+		path_push(path, x, y);
+	}
+	path_push(path, bz->pt3.x, bz->pt3.y);
+}
 
-		//Ziska bod stredovej pomerne
-		actual = ln_gpt(&line_md, &dc_md, ((float)i/desc.len)*dc_md.len);
+//Ukonci krivku v path
+static void path_end_curve(flat_path *path) {
+	if(path->curves == path->ends_cap) {
+		path->ends_cap = path->ends_cap ? 2 * path->ends_cap : 16;
+		path->ends = realloc(path->ends, path->ends_cap * sizeof(int));
+	}
+	path->ends[path->curves++] = path->len;
+}
 
-		//spoji predchadzajuci kresleny bod z novym a vykresli
-		ln ln3 = new_ln(prew, actual);	
-		ln_dw(&ln3);
+//Zahodi projekciu aj vyrovnane krivky, vola sa pri kazdej zmene objektu
+void obj_changed(obj *object) {
+	object->screen_valid = 0;
+	object->flat.valid = 0;
+}
 
-		//aktualny zisteni bod sa stava predchadzajucim
-		prew = actual;
+//Prida lomenu ciaru pts[from..to-1] do aktualneho tahu
+void path_stroke(flat_path *path, int from, int to) {
+	int i;
+	for(i = from + 1; i < to; i++) {
+		stroke_segment(path->pts[i-1].x, path->pts[i-1].y, path->pts[i].x, path->pts[i].y);
 	}
 }
 
-//m_mul - nasobenie matic
+//prida segmenty bezierovej krivky do aktualneho tahu
+void bz_stroke(bz *bz) {
+	static flat_path scratch;
+	scratch.len = 0;
+	bz_flatten(bz, &scratch);
+	path_stroke(&scratch, 0, scratch.len);
+}
+
+//vykresli bezierovu krivku bz_dw - bezier_draw
+void bz_dw(bz *bz) {
+	stroke_begin();
+	bz_stroke(bz);
+	stroke_end(image);
+}
+
+//m_mul - nasobenie matic, result moze byt aj matrix_a alebo matrix_b
 void m_mul(float matrix_a[4][4], float matrix_b[4][4], float result[4][4]) {
 	int row_a, coll_b, element;
+	float tmp[4][4];
 
 	for(row_a = 0; row_a < 4; row_a++)
 		for(coll_b = 0; coll_b < 4; coll_b++) {
-			float sum = 0;
+			double sum = 0;
 			for(element = 0; element < 4; element++)
-				sum += matrix_a[row_a][element] * matrix_b[element][coll_b];
+				sum += (double)matrix_a[row_a][element] * matrix_b[element][coll_b];
 
-			result[row_a][coll_b] = sum;
+			tmp[row_a][coll_b] = sum;
 		}
-				
+	memcpy(result, tmp, sizeof(tmp));
 }
 
-//Tu mam zadefinovane pismeno r do struktury typu obj, ratam ze na zaciatku bude nalepene na obrazovke (z - 512)
-//moj 3d priestor je 512x512x512
-obj r = {
-	4,
-	{
-		{{50, 300, 512, 1}, {50, 50, 512, 1}, {150, 50, 512, 1}},
-		{{150, 50, 512, 1}, {250, 50, 512, 1}, {250, 300, 512, 1}},
-		{{50, 300, 512, 1}, {250, 300, 512, 1}, {500, 300, 512, 1}},
-		{{250, 300, 512, 1}, {375, 175, 512, 1}, {500, 50, 512, 1}}
-	}
-};
-
-//hnusny hack pretože projekcia mi vždy prepisala data, tak isto zdroj tej nestability
-obj *out_r;
+/*
+ * Zasobnik transformacii. Kazda transformacia sa len prinasobi zlava
+ * k matici objektu (posledna pridana sa vykona ako posledna), body sa
+ * prenasobia az raz pri vykreslovani jednou zlozenou maticou. Klidova
+ * poloha sa nemeni, takze sa chyby zaokruhlenia nescitavaju v bodoch,
+ * a rotacna cast matice sa po kazdej rotacii znova ortonormalizuje.
+ */
+void m_identity(float matrix[4][4]) {
+	float id[4][4] = M_IDENTITY;
+	memcpy(matrix, id, sizeof(id));
+}
 
-//prenasoby bod maticou a vrati vysledok ako novy bod
-pt mrx_pt(pt *point, float matrix[4][4]) {
-	pt result;
-	result.x = 
-		point->x * matrix[0][0] + point->y * matrix[0][1] + point->z * matrix[0][2] + point->w * matrix[0][3];
-	result.y = 
-		point->x * matrix[1][0] + point->y * matrix[1][1] + point->z * matrix[1][2] + point->w * matrix[1][3];
-	result.z =
-		point->x * matrix[2][0] + point->y * matrix[2][1] + point->z * matrix[2][2] + point->w * matrix[2][3];
-	result.w =
-		point->x * matrix[3][0] + point->y * matrix[3][1] + point->z * matrix[3][2] + point->w * matrix[3][3];
-	return result;
+int m_is_identity(float matrix[4][4]) {
+	float id[4][4] = M_IDENTITY;
+	return memcmp(matrix, id, sizeof(id)) == 0;
 }
 
-//Vykresli cely objekt, v podstate po jednom vykresli jeho bezierove krivky
-void obj_dw(obj *object) {
-	int len = object->len;
-	while(len-- > 0) {
-		bz_dw(&object->curves[len]);
+//sin a cos posledneho uhla sa pamataju, animacia toci stale o rovnaky uhol
+static void angle_sincos(float angle, float *s, float *c) {
+	static float last_angle = 0, last_s = 0, last_c = 1;
+	if(angle != last_angle) {
+		last_angle = angle;
+		last_s = sin(angle);
+		last_c = cos(angle);
 	}
+	*s = last_s;
+	*c = last_c;
 }
 
-//Vytvory kopiu objektu a vrati odkaz na nu
-obj* obj_copy(obj *object) {
-	obj *res = malloc(sizeof(obj)+object->len*sizeof(bz));
-	res->len = object->len;
-	memcpy(res->curves, object->curves, object->len * sizeof(bz)); 
-	return res;
+//Gram-Schmidt na riadkoch linearnej 3x3 casti, translacia ostava
+static void m_orthonormalize(float m[4][4]) {
+	int i, j, k;
+	for(i = 0; i < 3; i++) {
+		float len;
+		for(j = 0; j < i; j++) {
+			float dot = m[i][0]*m[j][0] + m[i][1]*m[j][1] + m[i][2]*m[j][2];
+			for(k = 0; k < 3; k++) m[i][k] -= dot * m[j][k];
+		}
+		len = sqrt(m[i][0]*m[i][0] + m[i][1]*m[i][1] + m[i][2]*m[i][2]);
+		for(k = 0; k < 3; k++) m[i][k] /= len;
+	}
 }
 
-//translate - prenasovy kazdy bod objektu translacnou maticou
-void obj_trans(obj *object, int vx, int vy, int vz) {
-	int len = object->len;
-	float matrix[4][4] = {
+void m_translate(float matrix[4][4], float vx, float vy, float vz) {
+	float trans[4][4] = {
 		{1, 0, 0, vx},
 		{0, 1, 0, vy},
 		{0, 0, 1, vz},
 		{0, 0, 0, 1 }
 	};
+	m_mul(trans, matrix, matrix);
+}
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
+//Rotacia okolo osy (0 - x, 1 - y, 2 - z) prechadzajucej bodom vx, vy, vz,
+//posun do 0, rotacia a posun naspet su zlozene do jednej matice
+void m_rotate_about(float matrix[4][4], int axis, float angle, float vx, float vy, float vz) {
+	float s, c;
+	float rot[4][4] = M_IDENTITY;
+	float v[3] = {vx, vy, vz};
+	int a = (axis + 1) % 3, b = (axis + 2) % 3, i;
+
+	angle_sincos(angle, &s, &c);
+	rot[a][a] = c;
+	rot[a][b] = -s;
+	rot[b][a] = s;
+	rot[b][b] = c;
+	//posledny stlpec je v - R v
+	for(i = 0; i < 3; i++) {
+		rot[i][3] = v[i] - (rot[i][0]*vx + rot[i][1]*vy + rot[i][2]*vz);
 	}
+	m_mul(rot, matrix, matrix);
+	m_orthonormalize(matrix);
 }
 
-//Rotacia podla osy z --//-- rotacnou maticou (rotacia podla bodu 0,0,0)
-void obj_rot_z(obj *object, float angle) {
-	int len = object->len;
-	float matrix[4][4] = {
-		{cos(angle), -1*sin(angle), 0, 0},
-		{sin(angle),    cos(angle), 0, 0},
-		{0         ,             0, 1, 0},
-		{0         ,             0, 0, 1}
-	};
+void m_rotate(float matrix[4][4], int axis, float angle) {
+	m_rotate_about(matrix, axis, angle, 0, 0, 0);
+}
+
+typedef float f32x4 __attribute__((vector_size(16)));
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
+static void soa_reserve(pt_soa *soa, int len) {
+	int cap = (len + 3) & ~3;
+	if(cap > soa->cap) {
+		soa->x = realloc(soa->x, cap * sizeof(float));
+		soa->y = realloc(soa->y, cap * sizeof(float));
+		soa->z = realloc(soa->z, cap * sizeof(float));
+		soa->w = realloc(soa->w, cap * sizeof(float));
+		soa->cap = cap;
 	}
+	soa->len = len;
 }
 
-//Rotacia podla osy x --//-- rotacnou maticou (rotacia podla bodu 0,0,0)
-void obj_rot_x(obj *object, float angle) {
-	int len = object->len;
-	float matrix[4][4] = {
-		{1,0,0,0},
-		{0,cos(angle), -sin(angle), 0},
-		{0,sin(angle), cos(angle), 0},
-		{0,0,0,1}
-	};
+void soa_free(pt_soa *soa) {
+	free(soa->x);
+	free(soa->y);
+	free(soa->z);
+	free(soa->w);
+	memset(soa, 0, sizeof(*soa));
+}
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
+//Rozlozi body kriviek do SoA, doplni do nasobku 4
+void soa_from_curves(pt_soa *soa, bz *curves, int len) {
+	pt *pts = (pt*)curves;
+	int i, count = 3 * len;
+
+	soa_reserve(soa, count);
+	for(i = 0; i < soa->cap; i++) {
+		pt p = (i < count) ? pts[i] : pts[count - 1];
+		soa->x[i] = p.x;
+		soa->y[i] = p.y;
+		soa->z[i] = p.z;
+		soa->w[i] = p.w;
 	}
 }
 
-//Rotacia podla osy y --//-- rotacnou maticou (rotacia podla bodu 0,0,0)
-void obj_rot_y(obj *object, float angle) {
-	int len = object->len;
-	float matrix[4][4] = {
-		{   cos(angle),   0,  sin(angle), 0},
-		{   0         ,   1,           0, 0},
-		{-1*sin(angle),   0,  cos(angle), 0},
-		{   0         ,   0,           0, 1}
-	};
+/*
+ * Prenasobi vsetky body maticou, styri body naraz, a zapise ich do out.
+ * S divide sa suradnice vydelia w (perspektiva).
+ */
+void soa_transform(pt_soa *soa, float m[4][4], int divide, pt *out) {
+	int i, lane;
+
+	for(i = 0; i < soa->cap; i += 4) {
+		f32x4 x, y, z, w, res[4];
+		int row;
+		memcpy(&x, &soa->x[i], sizeof(x));
+		memcpy(&y, &soa->y[i], sizeof(y));
+		memcpy(&z, &soa->z[i], sizeof(z));
+		memcpy(&w, &soa->w[i], sizeof(w));
+		for(row = 0; row < 4; row++) {
+			res[row] = x * m[row][0] + y * m[row][1] + z * m[row][2] + w * m[row][3];
+		}
+		if(divide) {
+			f32x4 inv = 1 / res[3];
+			res[0] *= inv;
+			res[1] *= inv;
+			res[2] *= inv;
+		}
+		for(lane = 0; lane < 4 && i + lane < soa->len; lane++) {
+			out[i + lane] = (pt){res[0][lane], res[1][lane], res[2][lane], res[3][lane]};
+		}
+	}
+}
+
+//Vzdialenost kamery od roviny z = 0, pouziva sa pri projekcii vsetkych objektov
+float camera_d = 512;
+
+//Obalova gula klidovej polohy, obsahuje vsetky riadiace body a teda aj krivky
+float *obj_bound(obj *object) {
+	float lo[3], hi[3], r2 = 0;
+	int i, j, k;
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
+	if(object->bound_valid) return object->bound;
+	for(k = 0; k < 3; k++) {
+		lo[k] = (&object->curves[0].pt1.x)[k];
+		hi[k] = lo[k];
 	}
+	for(i = 0; i < object->len; i++) {
+		pt *pts = &object->curves[i].pt1;
+		for(j = 0; j < BZ_PTS; j++) {
+			for(k = 0; k < 3; k++) {
+				lo[k] = min(lo[k], (&pts[j].x)[k]);
+				hi[k] = max(hi[k], (&pts[j].x)[k]);
+			}
+		}
+	}
+	for(k = 0; k < 3; k++) object->bound[k] = (lo[k] + hi[k]) / 2;
+	for(i = 0; i < object->len; i++) {
+		pt *pts = &object->curves[i].pt1;
+		for(j = 0; j < BZ_PTS; j++) {
+			float dx = pts[j].x - object->bound[0], dy = pts[j].y - object->bound[1], dz = pts[j].z - object->bound[2];
+			r2 = max(r2, dx*dx + dy*dy + dz*dz);
+		}
+	}
+	object->bound[3] = sqrt(r2);
+	object->bound_valid = 1;
+	return object->bound;
 }
 
-void bz_divw(bz *bz) {
-	int i;
-	pt *start = (pt*) bz;
-	
-	for(i=0;i<3;i++) {
-		start[i].x = start[i].x / start[i].w;
-		start[i].y = start[i].y / start[i].w;
-		start[i].z = start[i].z / start[i].w;
+//Obalova gula po transformacii maticou objektu, polomer sa nasobi najvacsou
+//dlzkou stlpca matice (pri rotaciach a posunoch je to 1)
+static void obj_bound_posed(obj *object, float out[4]) {
+	float *b = obj_bound(object), scale = 0;
+	int row, col;
+
+	for(row = 0; row < 3; row++) {
+		out[row] = object->matrix[row][0] * b[0] + object->matrix[row][1] * b[1]
+			+ object->matrix[row][2] * b[2] + object->matrix[row][3];
+	}
+	for(col = 0; col < 3; col++) {
+		float len = 0;
+		for(row = 0; row < 3; row++) len += object->matrix[row][col] * object->matrix[row][col];
+		scale = max(scale, len);
+	}
+	out[3] = b[3] * sqrt(scale);
+}
+
+//0 ak je objekt cely za blizkou rovinou alebo mimo obrazovky (rozsirenej o margin)
+//obraz gule sa odhadne z rohov jej obalovej kocky, ak je cela pred blizkou rovinou
+int obj_visible(obj *object, float d, float margin) {
+	float b[4], z0, z1, lo[2], hi[2];
+	int k;
+
+	obj_bound_posed(object, b);
+	z0 = b[2] - b[3];
+	z1 = b[2] + b[3];
+	if(z1 < NEAR_Z) return 0;
+	if(z0 < NEAR_Z) return 1; //gula pretina blizku rovinu, obraz nie je ohraniceny
+	for(k = 0; k < 2; k++) {
+		float a = (b[k] - b[3]) * d, c = (b[k] + b[3]) * d;
+		lo[k] = min(a / z0, a / z1);
+		hi[k] = max(c / z0, c / z1);
+		if(hi[k] < -margin || lo[k] > TEX_SIZE - 1 + margin) return 0;
+	}
+	return 1;
+}
+
+static inline pt pt_lerp(pt a, pt b, float t) {
+	return (pt){a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t};
+}
+
+//Cast krivky pre t z ta..tb (de Casteljau, blossom kvadratickej krivky)
+static bz bz_sub(bz *c, float ta, float tb) {
+	pt a0 = pt_lerp(c->pt1, c->pt2, ta), a1 = pt_lerp(c->pt2, c->pt3, ta);
+	pt b0 = pt_lerp(c->pt1, c->pt2, tb), b1 = pt_lerp(c->pt2, c->pt3, tb);
+	return (bz){pt_lerp(a0, a1, ta), pt_lerp(a0, a1, tb), pt_lerp(b0, b1, tb)};
+}
+
+static inline pt pt_divw(pt p) {
+	return (pt){p.x / p.w, p.y / p.w, p.z / p.w, p.w};
+}
+
+//Oreze krivku (body pred delenim w) blizkou rovinou w = near, casti pred nou
+//vydeli w a zapise do out, vrati ich pocet (0 az 2)
+static int bz_clip_near(bz c, float near, bz *out) {
+	float w0 = c.pt1.w, w1 = c.pt2.w, w2 = c.pt3.w;
+	float a = w0 - 2*w1 + w2, b = 2*(w1 - w0), k = w0 - near;
+	float t[4];
+	int n = 0, pieces = 0, i;
+
+	if(w0 < near && w1 < near && w2 < near) return 0;
+	t[n++] = 0;
+	if(w0 < near || w1 < near || w2 < near) {
+		//korene a*t^2 + b*t + k = 0 v (0, 1), vzostupne
+		if(fabs(a) < 1e-9) {
+			if(b != 0 && -k / b > 0 && -k / b < 1) t[n++] = -k / b;
+		} else {
+			float disc = b*b - 4*a*k;
+			if(disc >= 0) {
+				float q = sqrt(disc), r0 = (-b - q) / (2*a), r1 = (-b + q) / (2*a);
+				if(r0 > r1) { float tmp = r0; r0 = r1; r1 = tmp; }
+				if(r0 > 0 && r0 < 1) t[n++] = r0;
+				if(r1 > 0 && r1 < 1 && r1 != r0) t[n++] = r1;
+			}
+		}
+	}
+	t[n++] = 1;
+	for(i = 0; i + 1 < n; i++) {
+		float mid = (t[i] + t[i+1]) / 2;
+		bz piece;
+		if(a*mid*mid + b*mid + k < 0) continue;
+		piece = (n == 2) ? c : bz_sub(&c, t[i], t[i+1]);
+		//stredny bod moze byt za rovinou aj ked krivka nie je, potom staci usecka
+		if(piece.pt2.w < near) piece.pt2 = pt_lerp(piece.pt1, piece.pt3, 0.5);
+		out[pieces++] = (bz){pt_divw(piece.pt1), pt_divw(piece.pt2), pt_divw(piece.pt3)};
 	}
+	return pieces;
 }
 
-//perspektivna matica
-//toto on chcel aby sme robili tak ako su robene funkcie obj_trot_*
-//teda ze vynasobim vsetky transformacne matice co chcem pouzit a nakoniec
-//vsetky body vyslednou maticou, mne to ale nejak neslo
-void obj_persp(obj *object, float d) {
-	int len = object->len;
+//Premietne krivky objektu do obrazovky (perspektiva P * matrix a delenie w)
+//vysledok ide do trvaleho pola object->screen, zdroj ostava nezmeneny
+//ak sa nezmenil objekt ani kamera, projekcia sa preskoci
+//ked obalova gula pretina blizku rovinu, krivky sa orezu (bz_clip_near)
+bz *obj_project(obj *object, float d) {
 	float matrix[4][4] = {
 		{1, 0, 0, 0 },
 		{0, 1, 0, 0 },
 		{0, 0, 1, 0 },
 		{0, 0, 1/d,0}
 	};
+	float b[4];
+	int i;
+
+	if(object->screen_valid && object->screen_d == d) return object->screen;
+	if(object->rest.len != 3 * object->len) {
+		soa_from_curves(&object->rest, object->curves, object->len);
+	}
+	if(object->screen == NULL) {
+		object->screen = malloc(2 * object->len * sizeof(bz));
+	}
+	m_mul(matrix, object->matrix, matrix);
+	obj_bound_posed(object, b);
+	if(b[2] - b[3] >= NEAR_Z) {
+		soa_transform(&object->rest, matrix, 1, (pt*)object->screen);
+		object->screen_len = object->len;
+	} else {
+		//body pred delenim do druhej polovice, orezane krivky sa pisu od zaciatku,
+		//zapis nikdy nepredbehne citanie (najviac 2 krivky za kazdu precitanu)
+		bz *posed = object->screen + object->len;
+		soa_transform(&object->rest, matrix, 0, (pt*)posed);
+		object->screen_len = 0;
+		for(i = 0; i < object->len; i++) {
+			object->screen_len += bz_clip_near(posed[i], NEAR_Z / d, &object->screen[object->screen_len]);
+		}
+	}
+	object->screen_d = d;
+	object->screen_valid = 1;
+	object->flat.valid = 0;
+	return object->screen;
+}
+
+//Vyrovna vsetky premietnute krivky objektu, ak sa od posledneho razu nezmenil necha cache
+flat_path *obj_flatten(obj *object) {
+	flat_path *path = &object->flat;
+	int i;
+
+	bz *curves;
+
+	curves = obj_project(object, camera_d);
+	if(path->valid) return path;
+	path->len = 0;
+	path->curves = 0;
+	for(i = 0; i < object->screen_len; i++) {
+		bz_flatten(&curves[i], path);
+		path_end_curve(path);
+	}
+	path->valid = 1;
+	return path;
+}
+
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
-		bz_divw(&object->curves[len]);
+//Tu mam zadefinovane pismeno r do struktury typu obj, ratam ze na zaciatku bude nalepene na obrazovke (z - 512)
+//moj 3d priestor je 512x512x512
+obj r = {
+	.len = 4,
+	.matrix = M_IDENTITY,
+	.curves = {
+		{{50, 300, 512, 1}, {50, 50, 512, 1}, {150, 50, 512, 1}},
+		{{150, 50, 512, 1}, {250, 50, 512, 1}, {250, 300, 512, 1}},
+		{{50, 300, 512, 1}, {250, 300, 512, 1}, {500, 300, 512, 1}},
+		{{250, 300, 512, 1}, {375, 175, 512, 1}, {500, 50, 512, 1}}
+	}
+};
+
+//Vykresli cely objekt ako jeden tah, krivky sa spoja a kazdy pixel sa zapise raz
+void obj_dw(obj *object) {
+	flat_path *path = obj_flatten(object);
+	int i;
+	stroke_begin();
+	for(i = 0; i < path->curves; i++) {
+		path_stroke(path, i ? path->ends[i-1] : 0, path->ends[i]);
 	}
+	stroke_end(image);
+}
+
+/*
+ * Vyplnanie tvarov cez akumulacny buffer (ako rychle rasterizery pisma).
+ * Kazdy segment obrysu prida do buniek riadku, ktore pretne, svoj
+ * znamienkovy prispevok k ploche (smer hore/dole urcuje znamienko).
+ * Prefixovy sucet riadku potom da pre kazdy pixel vinutie s ciastocnym
+ * pokrytim na okrajoch, z neho sa podla pravidla vinutia urci pokrytie
+ * a pixel sa zmiesa s farbou pera. Buffer je riedky, pre kazdy riadok sa
+ * pamata rozsah buniek ktorych sa segmenty dotkli, len ten sa scita a
+ * vynuluje, prazdne riadky sa preskocia.
+ */
+typedef struct {
+	float cells[TEX_SIZE][TEX_SIZE + 2]; //Prispevky k ploche, posledne dve bunky zachytia pravy okraj
+	short lo[TEX_SIZE]; //Rozsah pouzitych buniek v riadku, lo > hi ak je prazdny
+	short hi[TEX_SIZE];
+	int row_lo; //Rozsah pouzitych riadkov
+	int row_hi;
+} coverage_buf;
+
+coverage_buf coverage;
+int fill_rule = FILL_NONZERO;
+
+void fill_begin() {
+	int x;
+	for(x = 0; x < TEX_SIZE; x++) {
+		coverage.lo[x] = TEX_SIZE + 2;
+		coverage.hi[x] = -1;
+	}
+	coverage.row_lo = TEX_SIZE;
+	coverage.row_hi = -1;
+}
+
+static inline void fill_cell(int x, int y, float area) {
+	coverage.cells[x][y] += area;
+	if(y < coverage.lo[x]) coverage.lo[x] = y;
+	if(y > coverage.hi[x]) coverage.hi[x] = y;
+}
+
+//Prida znamienkovu plochu useku obrysu, x je riadok a y poloha v riadku
+//pixel x, y pokryva stvorec [x-0.5, x+0.5) x [y-0.5, y+0.5), rovnako ako pri tahoch
+void fill_segment(float x0, float y0, float x1, float y1) {
+	float dir = 1, dydx, y;
+	int x, x_end;
+
+	x0 += 0.5; y0 += 0.5; x1 += 0.5; y1 += 0.5;
+	if(x0 == x1) return;
+	if(x0 > x1) {
+		float t;
+		t = x0; x0 = x1; x1 = t;
+		t = y0; y0 = y1; y1 = t;
+		dir = -1;
+	}
+	dydx = (y1 - y0) / (x1 - x0);
+	y = y0;
+	if(x0 < 0) {
+		y -= x0 * dydx;
+		x0 = 0;
+	}
+	x_end = min((int)ceil(x1), TEX_SIZE);
+	if(x0 < x_end) {
+		coverage.row_lo = min(coverage.row_lo, (int)x0);
+		coverage.row_hi = max(coverage.row_hi, x_end - 1);
+	}
+	for(x = x0; x < x_end; x++) {
+		float dx = min(x + 1, x1) - max(x, x0);
+		float y_next = y + dydx * dx;
+		float d = dx * dir;
+		//poloha v riadku sa orezava na platnu, plocha vlavo sa zlozi do bunky 0
+		float ya = min(max(y, 0), TEX_SIZE), yb = min(max(y_next, 0), TEX_SIZE);
+		float lo = min(ya, yb), hi = max(ya, yb);
+		float lo_floor = floor(lo), hi_ceil = ceil(hi);
+		int lo_i = lo_floor, hi_i = hi_ceil;
+
+		if(hi_i <= lo_i + 1) {
+			//usek v riadku lezi v jednej bunke
+			float mid = 0.5 * (ya + yb) - lo_floor;
+			fill_cell(x, lo_i, d - d * mid);
+			fill_cell(x, lo_i + 1, d * mid);
+		} else {
+			float s = 1 / (hi - lo);
+			float lo_f = lo - lo_floor;
+			float a0 = 0.5 * s * (1 - lo_f) * (1 - lo_f);
+			float hi_f = hi - hi_ceil + 1;
+			float am = 0.5 * s * hi_f * hi_f;
+			int i;
+
+			fill_cell(x, lo_i, d * a0);
+			if(hi_i == lo_i + 2) {
+				fill_cell(x, lo_i + 1, d * (1 - a0 - am));
+			} else {
+				float a1 = s * (1.5 - lo_f);
+				float a2 = a1 + (hi_i - lo_i - 3) * s;
+				fill_cell(x, lo_i + 1, d * (a1 - a0));
+				for(i = lo_i + 2; i < hi_i - 1; i++) coverage.cells[x][i] += d * s;
+				fill_cell(x, hi_i - 1, d * (1 - a2 - am));
+			}
+			fill_cell(x, hi_i, d * am);
+		}
+		y = y_next;
+	}
+}
+
+//Pokrytie pixelu z vinutia podla aktualneho pravidla
+static inline float fill_coverage(float winding) {
+	winding = fabs(winding);
+	if(fill_rule == FILL_EVENODD) {
+		winding -= 2 * floor(winding * 0.5);
+		return (winding > 1) ? 2 - winding : winding;
+	}
+	return min(winding, 1);
+}
+
+//Jeden prechod prefixoveho suctu cez pouzite bunky, zmiesa pixely s farbou pera
+//a bunky hned vynuluje, takze buffer je pripraveny na dalsi tvar
+void fill_end(pixel canvas[TEX_SIZE][TEX_SIZE]) {
+	int x, y;
+
+	for(x = coverage.row_lo; x <= coverage.row_hi; x++) {
+		float *cells = coverage.cells[x];
+		float acc = 0;
+		int lo = coverage.lo[x], hi = coverage.hi[x], last = min(hi, TEX_SIZE - 1);
+		int from = -1, to = -1;
+
+		if(lo > hi) continue;
+		for(y = lo; y <= last; y++) {
+			float cov;
+			acc += cells[y];
+			cells[y] = 0;
+			cov = fill_coverage(acc);
+			if(cov < 0.5 / 255) continue;
+			if(cov > 1 - 0.5 / 255) {
+				canvas[x][y] = (pixel){pen_red, pen_green, pen_blue};
+			} else {
+				pixel *pix = &canvas[x][y];
+				pix->r += (pen_red - pix->r) * cov;
+				pix->g += (pen_green - pix->g) * cov;
+				pix->b += (pen_blue - pix->b) * cov;
+			}
+			if(from < 0) from = y;
+			to = y;
+		}
+		for(; y <= hi; y++) cells[y] = 0;
+		if(from >= 0) drawn_add(x, from, to);
+		coverage.lo[x] = TEX_SIZE + 2;
+		coverage.hi[x] = -1;
+	}
+	coverage.row_lo = TEX_SIZE;
+	coverage.row_hi = -1;
+}
+
+//Vyplni vyrovnane krivky, za sebou iduce krivky (koniec jednej je zaciatok
+//dalsej) tvoria jeden obrys, kazdy obrys sa uzavrie useckou na svoj zaciatok
+void path_fill(flat_path *path, pixel canvas[TEX_SIZE][TEX_SIZE]) {
+	int i, j, start = 0;
+
+	fill_begin();
+	for(i = 0; i < path->curves; i++) {
+		int from = i ? path->ends[i-1] : 0, to = path->ends[i];
+		vec2 *pts = path->pts;
+
+		if(i > 0 && (pts[from].x != pts[from-1].x || pts[from].y != pts[from-1].y)) {
+			fill_segment(pts[from-1].x, pts[from-1].y, pts[start].x, pts[start].y);
+			start = from;
+		}
+		for(j = from + 1; j < to; j++) {
+			fill_segment(pts[j-1].x, pts[j-1].y, pts[j].x, pts[j].y);
+		}
+	}
+	if(path->len > 0) {
+		fill_segment(path->pts[path->len-1].x, path->pts[path->len-1].y, path->pts[start].x, path->pts[start].y);
+	}
+	fill_end(canvas);
+}
+
+//Vykresli objekt ako vyplneny tvar s vyhladenymi okrajmi
+void obj_fill(obj *object) {
+	path_fill(obj_flatten(object), image);
+}
+
+//translate - prida translaciu do matice objektu
+void obj_trans(obj *object, int vx, int vy, int vz) {
+	obj_changed(object);
+	m_translate(object->matrix, vx, vy, vz);
+}
+
+//Rotacia podla osy z (rotacia podla bodu 0,0,0)
+void obj_rot_z(obj *object, float angle) {
+	obj_changed(object);
+	m_rotate(object->matrix, 2, angle);
+}
+
+//Rotacia podla osy x (rotacia podla bodu 0,0,0)
+void obj_rot_x(obj *object, float angle) {
+	obj_changed(object);
+	m_rotate(object->matrix, 0, angle);
+}
+
+//Rotacia podla osy y (rotacia podla bodu 0,0,0)
+void obj_rot_y(obj *object, float angle) {
+	obj_changed(object);
+	m_rotate(object->matrix, 1, angle);
 }
 
 //Rotacia podla lubovolneho bodu
 //posuniem bod podla ktoreho chcem rotovat do 0, 0, 0
 //zrotujem a posuniem naspet
-//robi sa to tak ze vynasobim navzajom matice danych transformaci
-//a vyslednou prenasobim body objektu
 //TOU MATICOU KTOROU PRENASOBUJEM AKO POSLEDNOU, TA SA VKONA AKO PRVA
 void obj_trot_z(obj *object, float angle, int vx, int vy, int vz) {
-	int len = object->len;
-	float trans1[4][4] = {
-		{1, 0, 0, -1*vx},
-		{0, 1, 0, -1*vy},
-		{0, 0, 1, -1*vz}, 
-		{0, 0, 0,     1}
-	};
-	float rot_z[4][4] = {
-		{cos(angle), -1*sin(angle), 0, 0},
-		{sin(angle),    cos(angle), 0, 0},
-		{0         ,             0, 1, 0},
-		{0         ,             0, 0, 1}
-	};
-	float trans2[4][4] = {
-		{1, 0, 0, vx},
-		{0, 1, 0, vy},
-		{0, 0, 1, vz},
-		{0, 0, 0, 1 }
-	};
-	float matrix[4][4];
-	m_mul(trans2, rot_z, matrix);
-	m_mul(matrix, trans1, matrix);
-
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
-	}
+	obj_changed(object);
+	m_rotate_about(object->matrix, 2, angle, vx, vy, vz);
 }
 
 void obj_trot_y(obj *object, float angle, int vx, int vy, int vz) {
-	int len = object->len;
-	float trans1[4][4] = {
-		{1, 0, 0, -1*vx},
-		{0, 1, 0, -1*vy},
-		{0, 0, 1, -1*vz}, 
-		{0, 0, 0,     1}
-	};
-	float rot_y[4][4] = {
-		{   cos(angle),   0,  sin(angle), 0},
-		{   0         ,   1,           0, 0},
-		{-1*sin(angle),   0,  cos(angle), 0},
-		{   0         ,   0,           0, 1}
-	};
-	float trans2[4][4] = {
-		{1, 0, 0, vx},
-		{0, 1, 0, vy},
-		{0, 0, 1, vz},
-		{0, 0, 0, 1 }
-	};
-	float matrix[4][4];
-	m_mul(trans2, rot_y, matrix);
-	m_mul(matrix, trans1, matrix);
-
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
-	}
+	obj_changed(object);
+	m_rotate_about(object->matrix, 1, angle, vx, vy, vz);
 }
 
 void obj_trot_x(obj *object, float angle, int vx, int vy, int vz) {
-	int len = object->len;
-	float trans1[4][4] = {
-		{1, 0, 0, -1*vx},
-		{0, 1, 0, -1*vy},
-		{0, 0, 1, -1*vz}, 
-		{0, 0, 0,     1}
-	};
-	float rot_x[4][4] = {
-		{1,0,0,0},
-		{0,cos(angle), -sin(angle), 0},
-		{0,sin(angle), cos(angle), 0},
-		{0,0,0,1}
-	};
-	float trans2[4][4] = {
-		{1, 0, 0, vx},
-		{0, 1, 0, vy},
-		{0, 0, 1, vz},
-		{0, 0, 0, 1 }
-	};
-	float matrix[4][4];
-	m_mul(trans2, rot_x, matrix);
-	m_mul(matrix, trans1, matrix);
+	obj_changed(object);
+	m_rotate_about(object->matrix, 0, angle, vx, vy, vz);
+}
+
+//Rotacia na vsetkych bodoch, najprv z, potom y a x
+void obj_trot_xyz(obj *object, float angle, int vx, int vy, int vz) {
+	obj_changed(object);
+	m_rotate_about(object->matrix, 2, angle, vx, vy, vz);
+	m_rotate_about(object->matrix, 1, angle, vx, vy, vz);
+	m_rotate_about(object->matrix, 0, angle, vx, vy, vz);
+}
+
+/*
+ * Scena, vela objektov nacitanych zo suboru do jedneho suvisleho pola.
+ * Subor je textovy, riadok "obj n" zacne objekt s n kvadratickymi
+ * krivkami, za nim ide n riadkov po troch bodoch x y z, # zacina komentar.
+ */
+typedef struct {
+	int len; //Pocet objektov
+	obj **objs; //Odkazy na objekty v block
+	char *block; //Vsetky objekty za sebou, NULL ak scena len odkazuje na iny objekt
+	unsigned char *visible; //Vysledok orezania pre kazdy objekt z posledneho scene_project
+	int culled; //Kolko objektov sa v poslednom snimku vynechalo
+} scene;
+
+scene world;
+
+//Miesto pre objekt s n krivkami v bloku sceny, zarovnane na 16 bajtov
+static size_t scene_obj_size(int n) {
+	return (sizeof(obj) + n * sizeof(bz) + 15) & ~(size_t)15;
+}
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
+//Scena s jednym uz existujucim objektom
+void scene_from_obj(scene *s, obj *object) {
+	s->len = 1;
+	s->objs = malloc(sizeof(obj*));
+	s->objs[0] = object;
+	s->block = NULL;
+	s->visible = calloc(1, 1);
+}
+
+//Nacita scenu zo suboru, prvy prechod zisti velkost bloku, druhy ho naplni
+//vrati 0, pri chybe vypise riadok a vrati -1
+int scene_load(scene *s, char *path) {
+	FILE *file = fopen(path, "r");
+	char line[256];
+	size_t size = 0;
+	obj *object = NULL;
+	int pass, count = 0, n = 0, next, i = 0, line_no = 0, error = 0;
+
+	if(file == NULL) {
+		printf("Error openning %s\n", path);
+		return -1;
+	}
+	for(pass = 0; pass < 2 && !error; pass++) {
+		rewind(file);
+		size = 0;
+		count = n = i = line_no = 0;
+		while(!error && fgets(line, sizeof(line), file) != NULL) {
+			char *text = line + strspn(line, " \t\r\n");
+			float v[9];
+			line_no++;
+			if(*text == '\0' || *text == '#') continue;
+			if(sscanf(text, "obj %d", &next) == 1) {
+				//predosly objekt musi mat vsetky krivky
+				if(next <= 0 || i < n) {
+					error = 1;
+					break;
+				}
+				n = next;
+				if(pass == 1) {
+					object = (obj*)(s->block + size);
+					object->len = n;
+					m_identity(object->matrix);
+					s->objs[count] = object;
+				}
+				size += scene_obj_size(n);
+				count++;
+				i = 0;
+				continue;
+			}
+			if(count == 0 || i == n || sscanf(text, "%f %f %f %f %f %f %f %f %f",
+				&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8]) != 9) {
+				error = 1;
+				break;
+			}
+			if(pass == 1) {
+				object->curves[i] = (bz){{v[0], v[1], v[2], 1}, {v[3], v[4], v[5], 1}, {v[6], v[7], v[8], 1}};
+			}
+			i++;
+		}
+		if(!error && (count == 0 || i < n)) error = 1;
+		if(!error && pass == 0) {
+			s->block = calloc(1, size);
+			s->objs = malloc(count * sizeof(obj*));
+			s->visible = calloc(count, 1);
+			s->len = count;
+		}
+	}
+	fclose(file);
+	if(error) {
+		printf("Error in %s line %d\n", path, line_no);
+		return -1;
 	}
+	return 0;
 }
 
-//Rotacia na vsetkych bodoch
-void obj_trot_xyz(obj *object, float angle, int vx, int vy, int vz) {
-	int len = object->len;
-	float trans1[4][4] = {
-		{1, 0, 0, -1*vx},
-		{0, 1, 0, -1*vy},
-		{0, 0, 1, -1*vz}, 
-		{0, 0, 0,     1}
-	};
-	float rot_z[4][4] = {
-		{cos(angle), -1*sin(angle), 0, 0},
-		{sin(angle),    cos(angle), 0, 0},
-		{0         ,             0, 1, 0},
-		{0         ,             0, 0, 1}
-	};
-	float rot_y[4][4] = {
-		{   cos(angle),   0,  sin(angle), 0},
-		{   0         ,   1,           0, 0},
-		{-1*sin(angle),   0,  cos(angle), 0},
-		{   0         ,   0,           0, 1}
-	};
-	float rot_x[4][4] = {
-		{1,0,0,0},
-		{0,cos(angle), -sin(angle), 0},
-		{0,sin(angle), cos(angle), 0},
-		{0,0,0,1}
-	};
-	float trans2[4][4] = {
-		{1, 0, 0, vx},
-		{0, 1, 0, vy},
-		{0, 0, 1, vz},
-		{0, 0, 0, 1 }
-	};
-	float matrix[4][4];
-	m_mul(trans2, rot_x, matrix);
-	m_mul(matrix, rot_y, matrix);
-	m_mul(matrix, rot_z, matrix);
-	m_mul(matrix, trans1, matrix);
+//Transformacie celej sceny, kazdy objekt si ich sklada do svojej matice
+void scene_trans(scene *s, int vx, int vy, int vz) {
+	int i;
+	for(i = 0; i < s->len; i++) obj_trans(s->objs[i], vx, vy, vz);
+}
+
+//axis je 0, 1 alebo 2 pre x, y a z
+void scene_rot(scene *s, int axis, float angle) {
+	void (*rot[3])(obj*, float) = {obj_rot_x, obj_rot_y, obj_rot_z};
+	int i;
+	for(i = 0; i < s->len; i++) rot[axis](s->objs[i], angle);
+}
+
+void scene_trot(scene *s, int axis, float angle, int vx, int vy, int vz) {
+	void (*trot[3])(obj*, float, int, int, int) = {obj_trot_x, obj_trot_y, obj_trot_z};
+	int i;
+	for(i = 0; i < s->len; i++) trot[axis](s->objs[i], angle, vx, vy, vz);
+}
+
+void scene_trot_xyz(scene *s, float angle, int vx, int vy, int vz) {
+	int i;
+	for(i = 0; i < s->len; i++) obj_trot_xyz(s->objs[i], angle, vx, vy, vz);
+}
 
-	while(len-- > 0) {
-		object->curves[len].pt1 = mrx_pt(&object->curves[len].pt1, matrix);
-		object->curves[len].pt2 = mrx_pt(&object->curves[len].pt2, matrix);
-		object->curves[len].pt3 = mrx_pt(&object->curves[len].pt3, matrix);
+//Premietne a vyrovna viditelne objekty sceny, objekty mimo obrazovky
+//alebo za kamerou sa ani nepremietnu, okraj obrazovky sa rozsiri o hrubku pera
+void scene_project(scene *s) {
+	float margin = max(pen_width, 1) / 2.0 * M_SQRT2 + 1;
+	int i;
+
+	s->culled = 0;
+	for(i = 0; i < s->len; i++) {
+		s->visible[i] = obj_visible(s->objs[i], camera_d, margin);
+		if(s->visible[i]) obj_flatten(s->objs[i]);
+		else s->culled++;
+	}
+}
+
+//Vykresli objekty ktore scene_project nechal, obrysy vsetkych objektov su jeden tah
+void scene_raster(scene *s) {
+	int i, j;
+
+	stroke_begin();
+	for(i = 0; i < s->len; i++) {
+		flat_path *path;
+		if(!s->visible[i]) continue;
+		path = obj_flatten(s->objs[i]);
+		if(fill_mode) {
+			path_fill(path, image);
+			continue;
+		}
+		for(j = 0; j < path->curves; j++) {
+			path_stroke(path, j ? path->ends[j-1] : 0, path->ends[j]);
+		}
 	}
+	stroke_end(image);
+}
+
+void scene_dw(scene *s) {
+	scene_project(s);
+	scene_raster(s);
 }
 
+//Osi rotacie animacie v poradi v akom sa aplikuju a uhol za snimok
+char *anim_axes = "zy";
+float anim_angle = 0.2;
+
 //Jednoducha animacia, rotacia okolo vsetkych bodov
 void animate() {
-	obj_trans(&r, -200, -200, -512);
-	obj_rot_z(&r, 0.2);
-	obj_rot_y(&r, 0.2);
-	obj_trans(&r, 200, 200, 512);
-	free(out_r);
-	//Perspektivu robi na kopii objektu, pretoze po
-	//prenasobeni perspektivnou maticou sa objekt neda pouzit,
-	//nastavy z na rovnake hodnoty vo vsetkych bodoch
-	//takze neviem potom ako bol objekt zrotovany
-	out_r = obj_copy(&r);
+	char *axis;
+	scene_trans(&world, -200, -200, -512);
+	for(axis = anim_axes; *axis != '\0'; axis++) {
+		scene_rot(&world, *axis - 'x', anim_angle);
+	}
+	scene_trans(&world, 200, 200, 512);
+}
+
+#ifdef HEADLESS
+
+//Cas od *since v ns, *since sa posunie na teraz
+static long long lap(long long *since) {
+	long long now = trace_now_ns(), elapsed = now - *since;
+	*since = now;
+	return elapsed;
+}
+
+static double env_number(char *name, double def) {
+	char *env = getenv(name);
+	return (env != NULL && *env != '\0') ? atof(env) : def;
+}
+
+/*
+ * Bez okna (make vector_headless), vyrenderuje FRAMES snimkov animacie do
+ * pamate a zapise ich ako surove RGB video, TEX_SIZE x TEX_SIZE po 3 bajty,
+ * do suboru OUTPUT alebo na stdout (OUTPUT=none len meria). AXES su osi
+ * rotacie (napr. zy) a ANGLE uhol za snimok. Na stderr vypise snimky za
+ * sekundu a cas transformacie, projekcie, mazania a kreslenia.
+ *   FRAMES=240 AXES=xz ANGLE=0.05 SCENE=scene.txt ./vector_headless | ffplay -f rawvideo -pixel_format rgb24 -video_size 512x512 -
+ */
+int main(int argc, char ** argv) {
+	const char *stages[] = {"transform", "project", "clear", "rasterize", "output"};
+	long long spent[5] = {0}, start, mark, total;
+	int frames = env_number("FRAMES", 120), frame, i;
+	char *output = getenv("OUTPUT");
+	FILE *out = stdout;
+
+	if(getenv("AXES") != NULL) anim_axes = getenv("AXES");
+	if(anim_axes[strspn(anim_axes, "xyz")] != '\0') {
+		fprintf(stderr, "AXES can contain only x, y and z\n");
+		return EXIT_FAILURE;
+	}
+	anim_angle = env_number("ANGLE", anim_angle);
+	if(getenv("SCENE") != NULL) {
+		if(scene_load(&world, getenv("SCENE")) != 0) return EXIT_FAILURE;
+	} else {
+		scene_from_obj(&world, &r);
+	}
+	if(output != NULL && strcmp(output, "none") == 0) {
+		out = NULL;
+	} else if(output != NULL) {
+		out = fopen(output, "wb");
+		if(out == NULL) {
+			fprintf(stderr, "Error openning %s\n", output);
+			return EXIT_FAILURE;
+		}
+	}
+
+	start = trace_now_ns();
+	for(frame = 0; frame < frames; frame++) {
+		mark = trace_now_ns();
+		if(frame > 0) animate();
+		spent[0] += lap(&mark);
+		pen_set(155, 255, 175, 10);
+		scene_project(&world);
+		spent[1] += lap(&mark);
+		pen_set(255, 255, 255, 5);
+		canvas_clear(image);
+		spent[2] += lap(&mark);
+		pen_set(155, 255, 175, 10);
+		scene_raster(&world);
+		spent[3] += lap(&mark);
+		if(out != NULL) fwrite(image, sizeof(image), 1, out);
+		spent[4] += lap(&mark);
+	}
+	total = trace_now_ns() - start;
+	if(out != NULL && out != stdout) fclose(out);
+
+	fprintf(stderr, "%d frames in %.3f s, %.1f fps, %.1f fps without output\n",
+		frames, total / 1e9, frames / (total / 1e9), frames / ((total - spent[4]) / 1e9));
+	for(i = 0; i < 5; i++) {
+		fprintf(stderr, "  %-10s %8.3f ms/frame %5.1f %%\n",
+			stages[i], spent[i] / 1e6 / max(frames, 1), 100.0 * spent[i] / max(total, 1));
+	}
+	return EXIT_SUCCESS;
+}
+
+#elif !defined(BENCH)
+
+double target_fps = TARGET_FPS;
+double next_frame_ms; //Kedy ma byt dalsi snimok animacie
+int animation_id = 0; //Zahodi casovace z predchadzajuceho zapnutia animacie
+
+//Oznaci obraz na prekreslenie a poziada GLUT o jedno prekreslenie
+void request_redraw() {
+	dirty = 1;
+	glutPostRedisplay();
+}
+
+//Jeden krok animacie, dalsi sa naplanuje na presny cas podla target_fps,
+//ak nestihame, snimky sa zahodia a nedobiehaju sa
+void animation_tick(int id) {
+	double now;
+
+	if(!animation || id != animation_id) return;
+
+	TRACE_BEGIN(t_animate);
+	animate();
+	TRACE_END(t_animate, "transform", 0);
+	request_redraw();
+
+	now = glutGet(GLUT_ELAPSED_TIME);
+	next_frame_ms += 1000.0 / target_fps;
+	if(next_frame_ms < now) next_frame_ms = now;
+	glutTimerFunc(next_frame_ms - now, animation_tick, id);
 }
 
 /*
  * Handles keyboard input, switch modes by char 'm' and 
  * controll chars for variations are q,w,e,r,t,z,u,i
  * in layers you can use a and d to move animation
+ * c switches round and square line caps
+ * f switches between outline and filled shape, g switches non-zero and even-odd fill
  */
 void handle_keyboard(unsigned char ch, int x, int y) {
 	switch(ch) {
 		case 'r':
-			obj_trans(&r, 0, 0, 10);
-			free(out_r);
-			out_r = obj_copy(&r);
-			obj_persp(out_r, 512);
+			scene_trans(&world, 0, 0, 10);
 			break;
 		case 'e':
-			obj_trans(&r, 0, 0, -10);
-			free(out_r);
-			out_r = obj_copy(&r);
-			obj_persp(out_r, 512);
+			scene_trans(&world, 0, 0, -10);
 			break;
 		case 'y':
-			obj_trot_y(&r, 0.3, 200, 200, 512);
-			free(out_r);
-			out_r = obj_copy(&r);
-			obj_persp(out_r, 512);
+			scene_trot(&world, 1, 0.3, 200, 200, 512);
 			break;
 		case 'z':
-			obj_trot_z(&r, 0.3, 200, 200, 512);
-			free(out_r);
-			out_r = obj_copy(&r);
-			obj_persp(out_r, 512);
+			scene_trot(&world, 2, 0.3, 200, 200, 512);
 			break;
 		case 'x':
-			obj_trot_x(&r, 0.3, 200, 200, 512);
-			free(out_r);
-			out_r = obj_copy(&r);
-			obj_persp(out_r, 512);
+			scene_trot(&world, 0, 0.3, 200, 200, 512);
 			break;
 		case 'a':
 			animation = (animation) ? 0 : 1;
+			if(animation) {
+				next_frame_ms = glutGet(GLUT_ELAPSED_TIME);
+				glutTimerFunc(0, animation_tick, ++animation_id);
+			}
 			break;
 		case 'd':
-			obj_trot_xyz(&r, 0.2,250, 250, 500);
-			free(out_r);
-			out_r = obj_copy(&r);
-			obj_persp(out_r, 512);
+			scene_trot_xyz(&world, 0.2, 250, 250, 500);
+			break;
+		case 'c':
+			pen_set_cap((pen_cap == CAP_ROUND) ? CAP_SQUARE : CAP_ROUND);
+			break;
+		case 'f':
+			fill_mode = !fill_mode;
+			break;
+		case 'g':
+			fill_rule = (fill_rule == FILL_NONZERO) ? FILL_EVENODD : FILL_NONZERO;
 			break;
 	}
+	request_redraw();
 }
 
-
 // Initialize OpenGL state
 void init() {
 	// Texture setup
@@ -660,23 +1573,36 @@ void init() {
     gluOrtho2D(-1,1,-1,1);
     glLoadIdentity();
     glColor3f(1,1,1);
-	out_r = obj_copy(&r);
-	obj_persp(out_r, 512);
 }
 
 // Generate and display the image.
 void display() {
-	pen_set(255,255,255,5);
-	bucket_fill(image);
-
-    // Call user image generation
-	if(animation) animate();
-	pen_set(155, 255, 175, 10);
-	obj_dw(out_r);
-	
-    // Copy image to texture memory
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TEX_SIZE, TEX_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+	TRACE_FRAME_BEGIN();
+	//Ak sa nic nezmenilo, textura uz obsahuje posledny obraz
+	if(dirty) {
+		TRACE_BEGIN(t_clear);
+		pen_set(255,255,255,5);
+		canvas_clear(image);
+		TRACE_END(t_clear, "clear", 0);
+
+		// Call user image generation
+		TRACE_BEGIN(t_project);
+		pen_set(155, 255, 175, 10);
+		scene_project(&world);
+		TRACE_END(t_project, "project", 0);
+
+		TRACE_BEGIN(t_raster);
+		scene_raster(&world);
+		TRACE_END(t_raster, "rasterize", 0);
+
+		// Copy image to texture memory
+		TRACE_BEGIN(t_upload);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TEX_SIZE, TEX_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+		TRACE_END(t_upload, "upload", 0);
+		dirty = 0;
+	}
+	TRACE_BEGIN(t_present);
     // Clear screen buffer
     glClear(GL_COLOR_BUFFER_BIT);
     // Render a quad
@@ -688,12 +1614,23 @@ void display() {
     glEnd();
     // Display result
     glFlush();
-    glutPostRedisplay();
     glutSwapBuffers();
+	TRACE_END(t_present, "present", 0);
+	TRACE_FRAME_END();
 }
 
 // Main entry function
 int main(int argc, char ** argv) {
+	trace_init("vector");
+	if(getenv("TARGET_FPS") != NULL && atof(getenv("TARGET_FPS")) > 0) {
+		target_fps = atof(getenv("TARGET_FPS"));
+	}
+	//SCENE=subor nacita scenu, inak sa kresli len pismeno r
+	if(getenv("SCENE") != NULL) {
+		if(scene_load(&world, getenv("SCENE")) != 0) return EXIT_FAILURE;
+	} else {
+		scene_from_obj(&world, &r);
+	}
     // Init GLUT
     glutInit(&argc, argv);
     glutInitWindowSize(TEX_SIZE, TEX_SIZE);
@@ -707,3 +1644,150 @@ int main(int argc, char ** argv) {
     glutMainLoop();
     return EXIT_SUCCESS;
 }
+
+#else
+
+#include "bench.h"
+
+#define BENCH_CURVES 1024
+
+//Testovaci objekt, pismeno r rozkopirovane BENCH_CURVES krat
+obj *bench_obj;
+bz bench_rest[BENCH_CURVES];
+
+//Obdlznik ktory pokryje nakreslene pismeno r
+box bench_drawn;
+
+//Vrati testovaci objekt do povodneho stavu
+void bench_reset() {
+	memcpy(bench_obj->curves, bench_rest, sizeof(bench_rest));
+	m_identity(bench_obj->matrix);
+	obj_changed(bench_obj);
+}
+
+void bench_bz() {
+	bz *curves = obj_project(&r, camera_d);
+	int i;
+	for(i = 0; i < r.screen_len; i++) {
+		bz_dw(&curves[i]);
+	}
+}
+
+void bench_ln() {
+	ln line = {{20, 30, 0, 1}, {490, 300, 0, 1}};
+	ln_dw(&line);
+}
+
+void bench_flatten() {
+	r.flat.valid = 0;
+	obj_flatten(&r);
+}
+
+void bench_obj_dw() { obj_dw(&r); }
+void bench_obj_fill() { obj_fill(&r); }
+void bench_obj_dw_many() { obj_dw(bench_obj); }
+void bench_scene() { scene_dw(&world); }
+
+//Porovnanie, test vnutra (parita priesecnikov) pre kazdy pixel v obdlzniku
+//tvaru, bez vyhladenia okrajov
+void bench_inside() {
+	flat_path *path = obj_flatten(&r);
+	pixel color = {pen_red, pen_green, pen_blue};
+	int x, y, i;
+
+	for(x = bench_drawn.x0; x <= bench_drawn.x1; x++) {
+		for(y = bench_drawn.y0; y <= bench_drawn.y1; y++) {
+			int inside = 0;
+			for(i = 1; i <= path->len; i++) {
+				vec2 a = path->pts[i-1], b = path->pts[i % path->len];
+				if((a.x <= x) != (b.x <= x) && a.y + (x - a.x) * (b.y - a.y) / (b.x - a.x) < y) inside = !inside;
+			}
+			if(inside) image[x][y] = color;
+		}
+	}
+}
+void bench_fill() { bucket_fill(image); }
+
+void bench_clear() {
+	drawn = bench_drawn;
+	canvas_clear(image);
+}
+void bench_trans() { obj_trans(bench_obj, 1, 1, 1); }
+void bench_rot_x() { obj_rot_x(bench_obj, ANGLE); }
+void bench_rot_y() { obj_rot_y(bench_obj, ANGLE); }
+void bench_rot_z() { obj_rot_z(bench_obj, ANGLE); }
+void bench_trot_x() { obj_trot_x(bench_obj, ANGLE, 200, 200, 512); }
+void bench_trot_y() { obj_trot_y(bench_obj, ANGLE, 200, 200, 512); }
+void bench_trot_z() { obj_trot_z(bench_obj, ANGLE, 200, 200, 512); }
+void bench_trot_xyz() { obj_trot_xyz(bench_obj, ANGLE, 200, 200, 512); }
+void bench_project() { obj_changed(bench_obj); obj_project(bench_obj, camera_d); }
+void bench_project_cached() { obj_project(bench_obj, camera_d); }
+
+//Meria kreslenie a transformacie (make bench)
+int main(int argc, char ** argv) {
+	double pts = 3 * BENCH_CURVES;
+	double segments = 0;
+	double fill_px;
+	char *json = getenv("BENCH_JSON");
+	int i;
+
+	segments = obj_flatten(&r)->len - r.len;
+
+	bench_obj = calloc(1, sizeof(obj) + BENCH_CURVES * sizeof(bz));
+	bench_obj->len = BENCH_CURVES;
+	for(i = 0; i < BENCH_CURVES; i++) {
+		bench_rest[i] = r.curves[i % r.len];
+	}
+
+	pen_set(255, 255, 255, 5);
+	bench_run("bucket_fill", bench_fill, TEX_SIZE*TEX_SIZE, "px", 31, 1);
+	canvas_clear(image);
+	pen_set(155, 255, 175, 10);
+	obj_dw(&r);
+	bench_drawn = drawn;
+	pen_set(255, 255, 255, 5);
+	bench_run("canvas_clear (letter r)", bench_clear,
+		(double)(bench_drawn.x1 - bench_drawn.x0 + 1) * (bench_drawn.y1 - bench_drawn.y0 + 1), "px", 31, 10);
+	pen_set(155, 255, 175, 10);
+	bench_run("bz_dw (letter r)", bench_bz, segments, "seg", 31, 10);
+	bench_run("obj_flatten (letter r)", bench_flatten, segments, "seg", 31, 100);
+	bench_run("obj_dw cached (letter r)", bench_obj_dw, segments, "seg", 31, 10);
+	canvas_clear(image);
+	obj_fill(&r);
+	bench_drawn = drawn;
+	fill_px = (double)(bench_drawn.x1 - bench_drawn.x0 + 1) * (bench_drawn.y1 - bench_drawn.y0 + 1);
+	bench_run("obj_fill nonzero (letter r)", bench_obj_fill, fill_px, "px", 31, 10);
+	fill_rule = FILL_EVENODD;
+	bench_run("obj_fill evenodd (letter r)", bench_obj_fill, fill_px, "px", 31, 10);
+	fill_rule = FILL_NONZERO;
+	bench_run("inside test (letter r)", bench_inside, fill_px, "px", 5, 1);
+	bench_reset();
+	segments = obj_flatten(bench_obj)->len - bench_obj->len;
+	bench_run("obj_dw (1024 curves)", bench_obj_dw_many, segments, "seg", 31, 1);
+	//scena z repozitara, polovica objektov je mimo obrazovky
+	if(scene_load(&world, "scene.txt") == 0) {
+		bench_run("scene_dw (scene.txt)", bench_scene, world.len, "obj", 31, 10);
+	}
+	bench_run("ln_dw w10 round", bench_ln, 470, "px", 31, 10);
+	pen_set_cap(CAP_SQUARE);
+	bench_run("ln_dw w10 square", bench_ln, 470, "px", 31, 10);
+	pen_set_cap(CAP_ROUND);
+
+	//transformacie len skladaju maticu, body prenasobi az obj_project
+	bench_reset(); bench_run("obj_trans", bench_trans, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_rot_x", bench_rot_x, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_rot_y", bench_rot_y, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_rot_z", bench_rot_z, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_trot_x", bench_trot_x, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_trot_y", bench_trot_y, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_trot_z", bench_trot_z, 1, "op", 31, 100);
+	bench_reset(); bench_run("obj_trot_xyz", bench_trot_xyz, 1, "op", 31, 100);
+	bench_reset(); obj_trot_xyz(bench_obj, ANGLE, 200, 200, 512);
+	bench_run("obj_project", bench_project, pts, "pt", 31, 10);
+	bench_run("obj_project (unchanged)", bench_project_cached, pts, "pt", 31, 100);
+
+	bench_report("vector", json ? json : "vector_bench.json");
+	return EXIT_SUCCESS;
+}
+
+#endif